@@ -6,375 +6,2523 @@
 #include <cstdio>   // instead of <stdio.h>
 #include <cstdlib>  // instead of <stdlib.h>
 #include <cstring>  // instead of <string.h>
-#include <cfloat>   // instead of <float.h>
-#include <cmath>    // instead of <math.h>
+#include <climits>  // LLONG_MAX
+#include <csignal>  // -S: SIGUSR1, SIGINT, SIGTERM
+#include <stdint.h> // uintptr_t
+#include <chrono>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 //STL
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
 #include <queue>
+#include <string>
 #include <vector>
-#include <functional>  // for std::greater
+#include <thread>
+
+#include "wfq_engine.h"
+#include "wfq_profile.h"
 
 
 #define MAX_IP_LEN 16
 #define MAX_LINE_LEN 256
-#define MAX_CONNECTIONS 10000
+#define INITIAL_CONNECTION_CAPACITY 1024
 #define INITIAL_PACKET_CAPACITY 100000
-#define EPSILON 1e-9
-
+#define ARENA_CHUNK_BITS 20
+#define ARENA_CHUNK_SIZE (1 << ARENA_CHUNK_BITS)
+#define INPUT_BLOCK_SIZE (1 << 20)
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define ROUTE_HASH 0
+#define ROUTE_DST_PORT 1
+#define ROUTE_DST_IP 2
+#define TRACE_MAGIC "WFQTRACE"
+#define TRACE_VERSION 1
+#define SNAPSHOT_MAGIC "WFQSNAP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_CHECK_EVERY 4096 // time steps between looks at the clock for -i
+#define STATS_OFF 0
+#define STATS_CSV 1
+#define STATS_JSON 2
+// queueing delays go into log-linear buckets: exact below 16, then 16 buckets per power of two
+#define DELAY_SUB_BUCKET_BITS 4
+#define DELAY_BUCKETS ((64 - DELAY_SUB_BUCKET_BITS) << DELAY_SUB_BUCKET_BITS)
+#define INGEST_QUEUE_SIZE 4096 // packets in flight from a producer to its link
+#define PIPELINE_BATCH 256
+#define PIPELINE_RING_SIZE 64 // batches in flight between two stages
+#define PIPELINE_BLOCK_LINES 1024
+#define RECLAIM_TRIES 2 // idle connections looked at per new one
+
+// packed 4-tuple, ips in host byte order
 typedef struct {
-    char src_ip[MAX_IP_LEN];
-    int src_port;
-    char dst_ip[MAX_IP_LEN];
-    int dst_port;
+    unsigned int src_ip;
+    unsigned int dst_ip;
+    unsigned short src_port;
+    unsigned short dst_port;
 } Connection;
 
+// Idle connections give their ids to new ones when the ids do not show in the output. A connection
+// is idle once every packet parsed for it has been sent and the scheduler's flow_idle() agrees.
 typedef struct {
-    long long arrival_time;
-    char src_ip[MAX_IP_LEN];
-    int src_port;
-    char dst_ip[MAX_IP_LEN];
-    int dst_port;
-    int length;
+    int in_flight; // packets parsed and not sent yet
+    int idle_listed; // in idle_connections
+} ConnectionUse;
+
+// the weight of a reclaimed connection, it gets it back if it comes again
+typedef struct {
+    Connection key;
+    int used;
     double weight;
-    int has_weight;
-    char original_line[MAX_LINE_LEN];
+} KeptWeight;
 
-    // WFQ specific fields
-    double virtual_start_time;
-    double virtual_finish_time;
+// a parsed input line, waiting in pending_packets until the scheduler takes it
+typedef struct {
+    long long arrival_time;
+    double weight; // NO_WEIGHT if the line did not specify one
+    // the scheduler's cookie: (appearance_order << 32) | line_ref, line_ref being (chunk <<
+    // ARENA_CHUNK_BITS) | offset or the record index for a binary trace. With -T a PipelineLine*
+    // for text input.
+    unsigned long long cookie;
+    int length;
     int connection_id;
+    int flow_class; // -h: class of a connection's first packet, -1 otherwise
     int appearance_order;
-    char is_on_bus;
 } Packet;
 
+// an input line (or binary trace record) as a producer decodes it, before a link resolves its
+// connection and keeps its text
+typedef struct {
+    long long arrival_time;
+    double weight; // NO_WEIGHT if the line did not specify one
+    const char* line; // in the shared input, NULL for a binary trace record
+    Connection key;
+    int line_len;
+    int length;
+    int appearance_order; // -1 when the link numbers it as it takes it (-P, -m)
+} ParsedPacket;
+
+// the original lines are appended to 1MB chunks, a chunk goes back to the free list once
+// none of its lines are referenced
+typedef struct {
+    char* data;
+    int used;
+    int live;
+} ArenaChunk;
+
+// one record per transmitted packet when running with -b
 typedef struct {
-    Connection conn;
+    long long start_time;
+    int appearance_order; // 0 based index of the (non empty) input line
+    int connection_id;
+    int length;
+    int reserved;
+} OutputRecord;
+
+// Binary trace, written by -c and read instead of text when stdin starts with TRACE_MAGIC.
+// Layout (native byte order): TraceHeader, num_records TraceRecords, then the text of every
+// line, '\0' terminated, for the text output. Record i is the i-th non empty input line.
+typedef struct {
+    char magic[8];
+    int version;
+    int record_size;
+    long long num_records;
+    long long num_flows;
+    long long text_offset; // from the start of the file
+} TraceHeader;
+
+typedef struct {
+    long long arrival_time;
+    double weight; // NO_WEIGHT if the line did not specify one
+    unsigned long long text; // offset of the line in the text section
+    unsigned int src_ip;
+    unsigned int dst_ip;
+    unsigned short src_port;
+    unsigned short dst_port;
+    int length;
+    int flow; // connection id in a single link run, in order of first appearance
+    int reserved;
+} TraceRecord;
+
+// -S / -R: a single link's state between two time steps. Layout (native byte order): SnapshotHeader,
+// num_connections Connections, num_pending Packets, num_chunks SnapshotChunks, num_free_chunks ints,
+// num_lines SnapshotLines each followed by its text, flow_stats_count FlowStats, DELAY_BUCKETS
+// counts if has_histogram, with reclaim num_connections ConnectionUses, num_idle_connections ints and
+// num_kept_weights KeptWeights, then scheduler_size bytes of WfqScheduler::save().
+typedef struct {
+    char magic[8];
+    int version;
+    int binary_input;
+    int discipline;
+    int num_classes;
+    int binary_output;
+    int stats_format;
+    long long input_size; // -1 when the input was a pipe
+    long long input_offset; // of the next line to read, the next record for a binary trace
+    long long output_offset; // bytes written up to the snapshot
+    long long departures;
+    long long first_arrival;
+    long long last_finish;
+    long long arrival_clock;
+    int next_appearance_order;
+    int input_done;
+    int num_connections;
+    int num_pending;
+    int num_chunks;
+    int current_arena_chunk;
+    int num_free_chunks;
+    int num_lines;
+    int flow_stats_count;
+    int has_histogram;
+    int reclaim;
+    int num_idle_connections;
+    int num_kept_weights;
+    long long scheduler_size;
+} SnapshotHeader;
+
+// an arena chunk without its data, only the lines still needed are saved
+typedef struct {
+    int used;
+    int live;
+} SnapshotChunk;
+
+typedef struct {
+    unsigned int line_ref;
+    int len;
+} SnapshotLine;
+
+// -s: per connection counters, updated as packets go on the link
+typedef struct {
+    long long packets;
+    long long bytes;
+    long long delay_sum; // queueing delay = start of transmission - arrival
+    long long delay_max;
+    double weight; // the last one the input gave, 1 until then
+} FlowStats;
+
+// -h: hierarchical WFQ classes, read once and then built into every link's scheduler
+typedef struct {
+    int parent; // index into class_defs, -1 = the root
     double weight;
-    double virtual_finish_time;
+    char name[64];
+} ClassDef;
+
+// a connection matches when (key & mask) == match field by field
+typedef struct {
+    Connection match;
+    Connection mask;
+    int class_def;
+} ClassRule;
+
+// A decoded packet on its way to a link, with a copy of its line so that the producer can move on
+// through its input
+typedef struct {
+    ParsedPacket parsed; // parsed.line points at text, NULL for a binary trace record
+    char text[MAX_LINE_LEN];
+} IngestItem;
+
+// -P, -m: one producer thread feeds each IngestQueue and the link's thread merges all of them. -p:
+// the dispatcher feeds one queue per link. A queue is a bounded single producer, single consumer ring,
+// the producer fills a slot in place and publishes it with a release store of tail, the consumer
+// hands it back with a release store of head. A full ring makes the producer wait, so memory stays
+// at INGEST_QUEUE_SIZE items per queue however far ahead the input is.
+struct IngestQueue {
+    IngestItem* items; // INGEST_QUEUE_SIZE slots
+    std::atomic<unsigned int> head; // next item to take, written by the consumer
+    std::atomic<unsigned int> tail; // next slot to fill, written by the producer
+    std::atomic<int> done; // producer has published its last item
+    int bad_input; // the producer stopped at a line that is too long, read once it is joined
+    unsigned int head_seen; // producer's last look at head
+    unsigned int tail_seen; // consumer's last look at tail
+    int finished; // consumer has seen done and drained everything
+
+    IngestQueue() : items(new IngestItem[INGEST_QUEUE_SIZE]), head(0), tail(0), done(0), bad_input(0), head_seen(0),
+                    tail_seen(0), finished(0) {}
+    ~IngestQueue() { delete[] items; }
+};
+
+// -T: parse -> schedule -> output on three threads. Stages hand each other batches through
+// bounded single producer, single consumer rings of pointers, a NULL batch ends the stream.
+// A full ring makes the stage in front wait, nothing flows backwards so the stages cannot deadlock.
+typedef struct {
+    int count;
+    Packet packets[PIPELINE_BATCH];
+} PacketBatch;
+
+typedef struct {
+    int count;
+    WfqDeparture departures[PIPELINE_BATCH];
+} DepartureBatch;
+
+struct BatchRing {
+    void* slots[PIPELINE_RING_SIZE];
+    std::atomic<unsigned int> head; // next slot to pop, written by the consumer
+    std::atomic<unsigned int> tail; // next slot to push, written by the producer
+
+    BatchRing() : head(0), tail(0) {}
+};
+
+// The arena belongs to one thread, so with -T the parse stage copies lines into blocks instead
+// and the output stage frees a block once all of its lines are out.
+struct LineBlock;
+
+typedef struct {
+    LineBlock* block;
+    const char* text;
     int appearance_order;
-    int active;
-} ConnectionInfo;
+} PipelineLine;
+
+struct LineBlock {
+    PipelineLine lines[PIPELINE_BLOCK_LINES];
+    char text[PIPELINE_BLOCK_LINES * MAX_LINE_LEN];
+    int used_lines;
+    size_t used_text;
+    std::atomic<int> live; // lines not output yet, counting the unused ones until the block is closed
 
+    LineBlock() : used_lines(0), used_text(0), live(PIPELINE_BLOCK_LINES) {}
+};
 
-struct CompareByVFT {
-    bool operator()(const Packet& a, const Packet& b) const {
-        double diff = a.virtual_finish_time - b.virtual_finish_time;
+struct Pipeline {
+    BatchRing parsed; // PacketBatch*
+    BatchRing departed; // DepartureBatch*
+    LineBlock* block; // parse stage: where new lines go
+    DepartureBatch* departing; // schedule stage: being filled
 
-        if (fabs(diff) > EPSILON) return a.virtual_finish_time > b.virtual_finish_time;
-        return a.appearance_order > b.appearance_order;
-    }
+    Pipeline() : block(NULL), departing(NULL) {}
 };
 
-struct CompareByVST {
-    bool operator()(const Packet& a, const Packet& b) const {
-        double diff = a.virtual_start_time - b.virtual_start_time;
+// How to run a trace, set from the command line before anything runs and read only afterwards
+struct Options {
+    int binary_output; // -b: write OutputRecord structs instead of text
+    int num_ports; // -p: number of output links
+    int route_mode; // -r: ROUTE_HASH, ROUTE_DST_PORT or ROUTE_DST_IP
+    int discipline; // -d, -h
+    int stats_format; // -s: STATS_OFF, STATS_CSV or STATS_JSON
+    int event_trace; // -t: dump the scheduler's event ring after the run (WFQ_TRACE builds)
+    int producers; // -P: threads that parse the input for the single link, 1 = the link parses itself
+    std::vector<const char*> sources; // -m: traces merged into the single link instead of stdin, one producer each
+    int pipeline; // -T: parse and output on their own threads around the single link's scheduling
+    const char* snapshot_path; // -S: where snapshots go, NULL = never
+    double snapshot_interval; // -i: seconds between snapshots, 0 = only on signals
+    const char* restore_path; // -R: snapshot to carry on from
+    std::vector<ClassDef> class_defs;
+    std::vector<ClassRule> class_rules;
+
+    Options() : binary_output(0), num_ports(1), route_mode(ROUTE_HASH), discipline(DISCIPLINE_WFQ),
+                stats_format(STATS_OFF), event_trace(0), producers(1), pipeline(0), snapshot_path(NULL),
+                snapshot_interval(0), restore_path(NULL) {}
+};
 
-        if (fabs(diff) > EPSILON) return a.virtual_start_time > b.virtual_start_time;
-        return a.appearance_order > b.appearance_order;
+// One input trace. Read only once open_input() returns, except for first_block which the single
+// link of a run goes on filling.
+struct Input {
+    FILE* file;
+    const char* shared; // whole input, NULL when a single link reads it block by block
+    size_t shared_size;
+    int shared_mapped;
+    char* first_block; // what open_input() read of a pipe
+    size_t first_block_size;
+    const TraceHeader* trace_header; // set when the input is a binary trace
+    const TraceRecord* trace_records;
+    const char* trace_text;
+
+    Input() : file(NULL), shared(NULL), shared_size(0), shared_mapped(0), first_block(NULL), first_block_size(0),
+              trace_header(NULL), trace_records(NULL), trace_text(NULL) {}
+};
+
+// Everything one output link needs: its scheduler plus the input, connection table and output
+// around it. Functions only ever touch the Link they are handed (and read its Options and Input),
+// so links of one run (-p) and whole runs (-B) go on their own threads without sharing anything
+// mutable.
+struct Link {
+    const Options* options;
+    Input* input;
+    IngestQueue* ingest; // -P, -p: num_ingest queues to take packets from, NULL when the link parses its own input
+    int num_ingest;
+    Pipeline* parse_into; // -T parse stage: packets and lines go to this pipeline
+    Pipeline* pipeline; // -T scheduling link: arrivals come from, departures go to this pipeline
+    int port;
+    WfqScheduler scheduler; // flow ids are connection ids
+    Connection* connections;
+    int num_connections;
+    int connections_capacity;
+    int* conn_table; // open addressing, holds connection ids, -1 = empty slot
+    unsigned int conn_table_mask;
+    int reclaim; // ids of idle connections are reused, see ConnectionUse
+    ConnectionUse* connection_use; // reclaim only, indexed by connection id
+    std::deque<int> idle_connections; // all their packets sent, in that order
+    KeptWeight* kept_weights; // open addressing by hash_connection
+    unsigned int kept_weights_mask;
+    int num_kept_weights;
+    std::queue<Packet> pending_packets;
+    std::vector<ArenaChunk> arena_chunks;
+    std::vector<int> free_arena_chunks;
+    int current_arena_chunk;
+    int input_done;
+    int next_appearance_order; // counts every input line, also the ones routed to other links
+    const char* input_data; // the whole input when input_mapped, else input_block
+    size_t input_size;
+    size_t input_pos;
+    long long input_base; // offset of input_data in the input, moves on as blocks are read
+    int input_mapped;
+    char* input_block;
+    char* output_buffer;
+    size_t output_used;
+    long long output_written; // bytes flushed to output_file
+    FILE* output_file; // the run's output, or a temp file that run_trace() merges when there are several links
+    long long departures;
+    FlowStats* flow_stats; // -s only, indexed by connection id, owned by the scheduling thread
+    int flow_stats_count;
+    int flow_stats_capacity;
+    long long* delay_histogram; // DELAY_BUCKETS counts over all of the link's packets
+    long long first_arrival;
+    long long last_finish;
+    long long arrival_clock; // latest arrival time handed to the scheduler, see run_link()
+    long long time_steps; // -S: since the run (or the restored one) started
+    std::chrono::steady_clock::time_point last_snapshot;
+    int stopped; // -S: a signal asked to stop, the snapshot has been written
+    int bad_input; // next_input_line() stopped at a line that is too long
+
+    Link() : options(NULL), input(NULL), ingest(NULL), num_ingest(0), parse_into(NULL), pipeline(NULL), port(0), connections(NULL), num_connections(0), connections_capacity(0),
+             conn_table(NULL), conn_table_mask(0), reclaim(0), connection_use(NULL), kept_weights(NULL), kept_weights_mask(0),
+             num_kept_weights(0), current_arena_chunk(-1), input_done(0), next_appearance_order(0),
+             input_data(NULL), input_size(0), input_pos(0), input_base(0), input_mapped(0), input_block(NULL),
+             output_buffer(NULL), output_used(0), output_written(0), output_file(NULL), departures(0), flow_stats(NULL),
+             flow_stats_count(0), flow_stats_capacity(0),
+             delay_histogram(NULL), first_arrival(LLONG_MAX), last_finish(0), arrival_clock(LLONG_MIN), time_steps(0), stopped(0), bad_input(0) {}
+
+    ~Link() {
+        for (size_t i = 0; i < arena_chunks.size(); i++) free(arena_chunks[i].data);
+        free(connections);
+        free(conn_table);
+        free(connection_use);
+        free(kept_weights);
+        free(output_buffer); // input_block belongs to the Input
+        free(flow_stats);
+        free(delay_histogram);
     }
 };
 
-// Global state
-ConnectionInfo connections[MAX_CONNECTIONS];
-int num_connections = 0;
-double virtual_time = 0.0;
-double next_departure_time = 0; // Represents when the server becomes free next
-std::queue<Packet> pending_packets;
-std::priority_queue<Packet, std::vector<Packet>, CompareByVFT> ready_queue;
-std::priority_queue<Packet, std::vector<Packet>, CompareByVFT> virtual_bus;
-std::priority_queue<Packet, std::vector<Packet>, CompareByVST> wait_for_virtual_bus;
-double last_virtual_change = 0.0;
-double current_time = 0.0;
-char is_packet_on_bus = 0;
-int packet_on_bus_idx = 0;
-int should_remove_from_virtual_bus = 0;
-long long next_virtual_end = 0;
-double sum_active_weight = 0.0;
-int Debug = 0;
-int debug_arrival_time_2 = 438091;
-int debug_arrival_time_1 = 538091;
-int debug_func_use = 0;
+// -B: one trace of a batch, timed as a whole
+typedef struct {
+    std::string path;
+    std::string output_path;
+    std::string stats_path;
+    std::string events_path;
+    long long size;
+    int ok;
+    long long packets;
+    double wall_s;
+} BatchJob;
+
+// one per batch worker, the owner pops from the front and thieves take from the back
+struct BatchQueue {
+    std::mutex lock;
+    std::deque<int> jobs;
+};
+
+// -S: set by the signal handlers, looked at between two time steps
+volatile sig_atomic_t snapshot_requested = 0;
+volatile sig_atomic_t stop_requested = 0;
 
 // Function prototypes
-int find_or_create_connection(const char* src_ip, int src_port, const char* dst_ip, int dst_port, int appearance_order);
-void parse_packet(const char* line, Packet* packet, int appearance_order);
-void schedule_next_packet();
-char* my_strdup(const char* s);
-void parse_file();
-void add_to_virtual_bus(Packet* packet);
-void handle_packet_arrival(Packet* packet);
-void remove_from_virtual_bus();
+int find_or_create_connection(Link* link, const Connection* key, int* created);
+unsigned int hash_connection(const Connection* c);
+void grow_conn_table(Link* link);
+void build_conn_table(Link* link, unsigned int size);
+void remove_from_conn_table(Link* link, int id);
+int reclaim_connection(Link* link);
+void keep_weight(Link* link, const Connection* key, double weight);
+double take_kept_weight(Link* link, const Connection* key);
+void connection_sent(Link* link, int id);
+void parse_packet(Link* link, const char* line, size_t len, Packet* packet, int appearance_order);
+void decode_line(const char* line, size_t len, ParsedPacket* parsed);
+void decode_record(const Input* input, long long index, ParsedPacket* parsed);
+void accept_packet(Link* link, const ParsedPacket* parsed, Packet* packet);
+void ingest_push(IngestQueue* queue, const ParsedPacket* parsed);
+const ParsedPacket* ingest_peek(IngestQueue* queue);
+void ingest_pop(IngestQueue* queue);
+int read_ingested(Link* link);
+size_t chunk_start(const Input* input, int producer, int num_producers);
+void produce(const Input* input, std::vector<IngestQueue>* queues, int producer);
+void produce_source(Link* reader, IngestQueue* queue);
+void dispatch(Link* reader, std::vector<IngestQueue>* queues);
+void load_record(Link* link, unsigned int index, Packet* packet);
+int convert_trace(Link* link);
+int route_port(const Options* options, const Connection* key);
+void read_class_config(Options* options, const char* path);
+int classify_connection(const Options* options, const Connection* key);
+const char* parse_uint(const char* p, const char* end, long long* value);
+const char* parse_ipv4(const char* p, const char* end, unsigned int* addr);
+const char* parse_weight(const char* p, const char* end, double* weight);
+int open_input(Input* input, int whole);
+int open_trace(Input* input);
+void close_input(Input* input);
+const char* packet_line(Link* link, unsigned int line_ref);
+void init_link(Link* link, const Options* options, Input* input, int port, FILE* output_file);
+void run_link(Link* link);
+int run_trace(const Options* options, FILE* in, FILE* out, const char* stats_path, const char* events_path,
+              long long* packets);
+int write_events(Link* const* links, int num_links, const char* events_path);
+int delay_bucket(long long delay);
+long long delay_bucket_max(int bucket);
+long long delay_percentile(const long long* histogram, long long count, double q);
+FlowStats* flow_stats_at(Link* link, int id);
+void record_stats(Link* link, const WfqDeparture* departure);
+void send_departure(Link* link, const WfqDeparture* departure);
+void ring_push(BatchRing* ring, void* batch);
+void* ring_pop(BatchRing* ring);
+unsigned long long keep_line(Pipeline* pipeline, const char* line, size_t len, int appearance_order);
+void release_kept_line(const PipelineLine* kept);
+void close_line_block(Pipeline* pipeline);
+int take_parsed_batch(Link* link);
+void parse_stage(Link* link);
+void output_stage(Link* link);
+void format_ip(char* dst, size_t size, unsigned int ip);
+void write_flow_stats(FILE* file, const Link* link, int id, int json);
+int write_stats(Link* const* links, int num_links, const char* path);
+void merge_link_outputs(std::vector<Link>& links, FILE* out);
+int run_batch(const Options* options, const char* list, const char* output_dir, int num_workers);
+void batch_worker(std::vector<BatchJob>* jobs, std::vector<BatchQueue>* queues, int self, const Options* options);
+int next_input_line(Link* link, const char** line, size_t* len);
+void report_long_line(long long offset);
+char* format_ll(char* dst, long long value);
+void output_packet(Link* link, const WfqDeparture* departure);
+void output_flush(Link* link);
+void on_snapshot_signal(int sig);
+void snapshot_point(Link* link);
+int write_snapshot(Link* link, const char* path);
+int restore_snapshot(Link* link, const char* path);
+int read_snapshot_part(const char** p, const char* end, void* dst, size_t size);
+int read_next_packet(Link* link);
+void refill_pending(Link* link);
+unsigned int arena_store_line(Link* link, const char* line, size_t len);
+const char* arena_line(Link* link, unsigned int line_ref);
+void arena_release_line(Link* link, unsigned int line_ref);
+
+
+
+
+unsigned int arena_store_line(Link* link, const char* line, size_t len) {
+    if (link->current_arena_chunk == -1 || link->arena_chunks[link->current_arena_chunk].used + (int)len + 1 > ARENA_CHUNK_SIZE) {
+        if (link->current_arena_chunk != -1 && link->arena_chunks[link->current_arena_chunk].live == 0) {
+            link->arena_chunks[link->current_arena_chunk].used = 0; // nothing left in it, keep filling it from the start
+        } else if (!link->free_arena_chunks.empty()) {
+            link->current_arena_chunk = link->free_arena_chunks.back();
+            link->free_arena_chunks.pop_back();
+        } else {
+            ArenaChunk chunk;
+            chunk.data = (char*)malloc(ARENA_CHUNK_SIZE);
+            chunk.used = 0;
+            chunk.live = 0;
+            link->arena_chunks.push_back(chunk);
+            link->current_arena_chunk = (int)link->arena_chunks.size() - 1;
+        }
+    }
+    ArenaChunk* chunk = &link->arena_chunks[link->current_arena_chunk];
+    unsigned int line_ref = ((unsigned int)link->current_arena_chunk << ARENA_CHUNK_BITS) | (unsigned int)chunk->used;
+    memcpy(chunk->data + chunk->used, line, len);
+    chunk->data[chunk->used + len] = 0;
+    chunk->used += (int)len + 1;
+    chunk->live++;
+    return line_ref;
+}
+
+const char* arena_line(Link* link, unsigned int line_ref) {
+    return link->arena_chunks[line_ref >> ARENA_CHUNK_BITS].data + (line_ref & (ARENA_CHUNK_SIZE - 1));
+}
 
+const char* packet_line(Link* link, unsigned int line_ref) {
+    const Input* input = link->input;
+    return (input->trace_header != NULL) ? input->trace_text + input->trace_records[line_ref].text : arena_line(link, line_ref);
+}
 
+void arena_release_line(Link* link, unsigned int line_ref) {
+    int chunk_idx = (int)(line_ref >> ARENA_CHUNK_BITS);
+    ArenaChunk* chunk = &link->arena_chunks[chunk_idx];
+    if (--chunk->live == 0 && chunk_idx != link->current_arena_chunk) {
+        chunk->used = 0;
+        link->free_arena_chunks.push_back(chunk_idx);
+    }
+}
 
+// reads one packet from the input into pending_packets, returns 0 once the input is exhausted
+int read_next_packet(Link* link) {
+    if (link->pipeline != NULL) {
+        return take_parsed_batch(link);
+    }
+    if (link->ingest != NULL) {
+        return read_ingested(link);
+    }
+    PROFILE_BEGIN();
+    if (link->input->trace_header != NULL) {
+        if (link->input_pos < (size_t)link->input->trace_header->num_records) {
+            Packet packet;
+            load_record(link, (unsigned int)link->input_pos++, &packet);
+            link->pending_packets.push(packet);
+            PROFILE_END(profile_parse_ns);
+            return 1;
+        }
+        link->input_done = 1;
+        PROFILE_END(profile_parse_ns);
+        return 0;
+    }
+    const char* line;
+    size_t len;
+    while (next_input_line(link, &line, &len)) {
+        if (len == 0) continue;
+        Packet packet;
+        parse_packet(link, line, len, &packet, link->next_appearance_order++);
+        link->pending_packets.push(packet);
+        PROFILE_END(profile_parse_ns);
+        return 1;
+    }
+    link->input_done = 1;
+    PROFILE_END(profile_parse_ns);
+    return 0;
+}
 
-char* my_strdup(const char* s) {
-    size_t len = strlen(s) + 1;
-    char* copy = (char*)malloc(len);
-    if (copy) {
-        memcpy(copy, s, len);
+// mmap the input when it is a regular file. Otherwise the first block is read here: a binary trace,
+// or an input that several threads scan (whole: -P), is then read whole, else the one reader (the
+// single link, or the -p dispatcher) goes on reading INPUT_BLOCK_SIZE blocks as it needs them.
+// Returns 0 if the input is a binary trace that cannot be used.
+int open_input(Input* input, int whole) {
+#ifndef _WIN32
+    struct stat st;
+    int fd = fileno(input->file);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            input->shared = (const char*)map;
+            input->shared_size = (size_t)st.st_size;
+            input->shared_mapped = 1;
+            return open_trace(input);
+        }
+    }
+#endif
+    size_t capacity = INPUT_BLOCK_SIZE;
+    char* data = (char*)malloc(capacity);
+    size_t size = fread(data, 1, capacity, input->file);
+    if (!whole && (size < sizeof(TraceHeader) || memcmp(data, TRACE_MAGIC, 8) != 0)) {
+        input->first_block = data;
+        input->first_block_size = size;
+        return 1;
+    }
+    size_t n;
+    while (size == capacity) {
+        capacity *= 2;
+        data = (char*)realloc(data, capacity);
+        while (size < capacity && (n = fread(data + size, 1, capacity - size, input->file)) > 0) size += n;
     }
-    return copy;
+    input->shared = data;
+    input->shared_size = size;
+    return open_trace(input);
 }
 
-int compare_packets_by_virtual_finish_time(const void* a, const void* b) {
-    const Packet* pa = (const Packet*)a;
-    const Packet* pb = (const Packet*)b;
-    if (pa->virtual_finish_time < pb->virtual_finish_time) return -1;
-    if (pa->virtual_finish_time > pb->virtual_finish_time) return 1;
-    return pa->appearance_order - pb->appearance_order;
+// points the trace_ fields into the shared input if it holds a binary trace
+int open_trace(Input* input) {
+    if (input->shared_size < sizeof(TraceHeader) || memcmp(input->shared, TRACE_MAGIC, 8) != 0) return 1;
+    const TraceHeader* header = (const TraceHeader*)input->shared;
+    if (header->version != TRACE_VERSION || header->record_size != (int)sizeof(TraceRecord) ||
+        header->num_records < 0 || header->num_records > INT_MAX ||
+        header->text_offset < (long long)(sizeof(TraceHeader) + header->num_records * sizeof(TraceRecord)) ||
+        header->text_offset > (long long)input->shared_size) {
+        fprintf(stderr, "unsupported or truncated binary trace\n");
+        return 0;
+    }
+    input->trace_header = header;
+    input->trace_records = (const TraceRecord*)(input->shared + sizeof(TraceHeader));
+    input->trace_text = input->shared + header->text_offset;
+    return 1;
 }
 
-void parse_file() {
-    char line[MAX_LINE_LEN];
-    int appearance_order = 0;
-    while (fgets(line, sizeof(line), stdin)) {
-        line[strcspn(line, "\n")] = 0;
-        if (strlen(line) == 0) continue;
-        Packet packet;
-        parse_packet(line, &packet, appearance_order++);
-        pending_packets.push(packet);
+void close_input(Input* input) {
+#ifndef _WIN32
+    if (input->shared_mapped) {
+        munmap((void*)input->shared, input->shared_size);
+        input->shared = NULL;
     }
+#endif
+    free((void*)input->shared);
+    free(input->first_block);
+    input->shared = NULL;
+    input->first_block = NULL;
 }
 
-void progress_real_time(long long next_arrival_event_time) {
+void init_link(Link* link, const Options* options, Input* input, int port, FILE* output_file) {
+    link->options = options;
+    link->input = input;
+    link->port = port;
+    link->scheduler.set_discipline(options->discipline);
+    for (size_t i = 0; i < options->class_defs.size(); i++) {
+        link->scheduler.add_class(options->class_defs[i].parent + 1, options->class_defs[i].weight); // ids follow class_defs, 0 is the root
+    }
+    if (input->shared != NULL) {
+        link->input_data = input->shared;
+        link->input_size = input->shared_size;
+        link->input_mapped = 1;
+    } else {
+        link->input_block = input->first_block;
+        link->input_data = link->input_block;
+        link->input_size = input->first_block_size;
+    }
+    link->output_buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+    link->output_file = output_file;
+    link->last_snapshot = std::chrono::steady_clock::now();
+    // connection ids are internal unless -b, -s or -t print them. The -T parse stage cannot see the
+    // scheduler, and a binary trace comes with the converter's ids.
+    link->reclaim = !options->binary_output && options->stats_format == STATS_OFF && !options->event_trace &&
+                    !options->pipeline && input->trace_header == NULL;
+    if (options->stats_format != STATS_OFF) {
+        link->delay_histogram = (long long*)calloc(DELAY_BUCKETS, sizeof(long long));
+    }
+}
 
-    current_time = next_arrival_event_time;
-    if (next_departure_time < current_time && is_packet_on_bus){ //&& is_packet_on_bus) {
-        current_time = next_departure_time;
+// points line at the next line of input (not null terminated, no '\n'), returns 0 at end of input.
+// A line of MAX_LINE_LEN characters or more is not cut short, it is reported and reading stops
+// there with bad_input set.
+int next_input_line(Link* link, const char** line, size_t* len) {
+    if (link->bad_input) return 0;
+    const char* start = link->input_data + link->input_pos;
+    const char* nl = (const char*)memchr(start, '\n', link->input_size - link->input_pos);
+    if (nl == NULL && !link->input_mapped) {
+        // move the partial line to the front of the block and read more behind it
+        size_t left = link->input_size - link->input_pos;
+        memmove(link->input_block, start, left);
+        link->input_base += (long long)link->input_pos;
+        link->input_size = left + fread(link->input_block + left, 1, INPUT_BLOCK_SIZE - left, link->input->file);
+        link->input_pos = 0;
+        start = link->input_block;
+        nl = (const char*)memchr(start, '\n', link->input_size);
     }
-    if (!virtual_bus.empty() > 0) {
-        // qsort(virtual_bus.packets, virtual_bus.count, sizeof(Packet), compare_packets_by_virtual_finish_time);
-        double virtual_finish = virtual_bus.top().virtual_finish_time;
-        if ((current_time <= debug_arrival_time_1 && current_time >= debug_arrival_time_2) && Debug == 1) {
-            printf("reason for call: compute if next event is virtual departure \n\n");
+    if (nl == NULL) {
+        if (link->input_pos == link->input_size) return 0;
+        nl = link->input_data + link->input_size; // last line without a trailing newline, or a whole block without one
+    }
+    if (nl - start > MAX_LINE_LEN - 1) {
+        report_long_line(link->input_base + (long long)(start - link->input_data));
+        link->bad_input = 1;
+        return 0;
+    }
+    *line = start;
+    *len = (size_t)(nl - start);
+    link->input_pos = (size_t)(nl - link->input_data) + (nl < link->input_data + link->input_size);
+    return 1;
+}
+
+void report_long_line(long long offset) {
+    fprintf(stderr, "the input line at byte %lld is longer than %d characters\n", offset, MAX_LINE_LEN - 1);
+}
+
+// keep exactly one lookahead arrival so the main loop knows the next arrival time
+void refill_pending(Link* link) {
+    if (link->pending_packets.empty() && !link->input_done) {
+        read_next_packet(link);
+    }
+}
+
+void run_link(Link* link) {
+    refill_pending(link);
+    WfqDeparture departure;
+    while (!link->pending_packets.empty()) {
+        Packet packet = link->pending_packets.front();
+        link->pending_packets.pop();
+        refill_pending(link);
+
+        WfqPacket arrival;
+        arrival.flow = packet.connection_id;
+        arrival.length = packet.length;
+        arrival.weight = packet.weight;
+        arrival.cookie = packet.cookie;
+        if (packet.flow_class >= 0) {
+            link->scheduler.set_flow_class(packet.connection_id, packet.flow_class);
         }
-        double real_finish_virtual = last_virtual_change + (virtual_finish - virtual_time) *(sum_active_weight); //sum_Active_weights(); // sum_active_weight;
-        if (Debug == 1 && current_time == 1112533.0) {
-            printf("real_finish_virtual = %lf \n", real_finish_virtual);
+        // Input that is not sorted by time: a packet that arrives before one ahead of it in the input
+        // is taken in with that one, as the original main loop took every pending arrival up to its
+        // current time before it picked the next packet. It keeps its own arrival time, see enqueue().
+        if (packet.arrival_time > link->arrival_clock) link->arrival_clock = packet.arrival_time;
+        link->scheduler.enqueue(arrival, packet.arrival_time);
+        if (link->delay_histogram != NULL && packet.weight != NO_WEIGHT) {
+            flow_stats_at(link, packet.connection_id)->weight = packet.weight;
         }
-        if (real_finish_virtual <= current_time + EPSILON) {
-            current_time = real_finish_virtual;
-            should_remove_from_virtual_bus = 1; // will remove later, need to take into account when computing virtual
+
+        // every arrival at this time has to be in before the link picks its next packet
+        if (link->pending_packets.empty() || link->pending_packets.front().arrival_time > link->arrival_clock) {
+            while (link->scheduler.dequeue(link->arrival_clock, &departure)) {
+                send_departure(link, &departure);
+            }
+            if (link->options->snapshot_path != NULL) {
+                snapshot_point(link);
+                if (link->stopped) return;
+            }
         }
     }
+    while (link->scheduler.dequeue(LLONG_MAX, &departure)) {
+        send_departure(link, &departure);
+    }
+
+    if (link->pipeline != NULL) {
+        // the output stage flushes
+        if (link->pipeline->departing != NULL) ring_push(&link->pipeline->departed, link->pipeline->departing);
+        link->pipeline->departing = NULL;
+        ring_push(&link->pipeline->departed, NULL);
+        return;
+    }
+    PROFILE_BEGIN();
+    output_flush(link);
+    PROFILE_END(profile_output_ns);
 }
 
-void progress_virtual_time(long long next_arrival_event_time) {
-    double weight_sum =  sum_active_weight; //sum_Active_weights(); //sum_active_weight;
+// a departure leaves the scheduling loop, to the output or with -T to the output stage
+void send_departure(Link* link, const WfqDeparture* departure) {
+    if (link->delay_histogram != NULL) {
+        record_stats(link, departure);
+    }
+    if (link->reclaim) {
+        connection_sent(link, departure->flow);
+    }
+    Pipeline* pipeline = link->pipeline;
+    if (pipeline == NULL) {
+        output_packet(link, departure);
+        return;
+    }
+    if (pipeline->departing == NULL) {
+        pipeline->departing = new DepartureBatch;
+        pipeline->departing->count = 0;
+    }
+    pipeline->departing->departures[pipeline->departing->count++] = *departure;
+    if (pipeline->departing->count == PIPELINE_BATCH) {
+        ring_push(&pipeline->departed, pipeline->departing);
+        pipeline->departing = NULL;
+    }
+}
 
-    if (weight_sum >EPSILON) {
-        if ((current_time <= debug_arrival_time_1 && current_time >= debug_arrival_time_2) && Debug == 1) {
-            printf("virtual_time: %f, new virtual time %f, current_time %lf\n", virtual_time, virtual_time + (double)(current_time - last_virtual_change) / weight_sum, current_time);
-            printf("weight sum %f, time diff %lf \n", weight_sum, current_time - last_virtual_change);
-            printf("next arrival %lld current time %lf, next dep %lf\n", next_arrival_event_time, current_time, next_departure_time);
-        }
-        virtual_time += (double)(current_time - last_virtual_change) / weight_sum;
+void ring_push(BatchRing* ring, void* batch) {
+    unsigned int tail = ring->tail.load(std::memory_order_relaxed);
+    while (tail - ring->head.load(std::memory_order_acquire) == PIPELINE_RING_SIZE) {
+        std::this_thread::yield();
+    }
+    ring->slots[tail % PIPELINE_RING_SIZE] = batch;
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
 
+void* ring_pop(BatchRing* ring) {
+    unsigned int head = ring->head.load(std::memory_order_relaxed);
+    while (ring->tail.load(std::memory_order_acquire) == head) {
+        std::this_thread::yield();
     }
-    last_virtual_change = current_time;
+    void* batch = ring->slots[head % PIPELINE_RING_SIZE];
+    ring->head.store(head + 1, std::memory_order_release);
+    return batch;
 }
 
-void remove_from_virtual_bus() {
-    if ((virtual_bus.top().arrival_time <= debug_arrival_time_1  && virtual_bus.top().arrival_time >=  debug_arrival_time_2) && Debug == 1) {
-        printf("removing packet %s virtual time %lf\n", virtual_bus.top().original_line, virtual_time);
+// parse stage: a copy of the line that the output stage can read and free, returns its cookie
+unsigned long long keep_line(Pipeline* pipeline, const char* line, size_t len, int appearance_order) {
+    LineBlock* block = pipeline->block;
+    if (block == NULL || block->used_lines == PIPELINE_BLOCK_LINES) {
+        block = pipeline->block = new LineBlock(); // a full block needs no closing, every line counts
     }
-    sum_active_weight -= virtual_bus.top().weight;
-    virtual_bus.pop();
+    PipelineLine* kept = &block->lines[block->used_lines++];
+    char* text = block->text + block->used_text;
+    memcpy(text, line, len);
+    text[len] = 0;
+    block->used_text += len + 1;
+    kept->block = block;
+    kept->text = text;
+    kept->appearance_order = appearance_order;
+    return (unsigned long long)(uintptr_t)kept;
 }
 
-void add_to_virtual_bus(Packet* packet_to_add) {
-    sum_active_weight += packet_to_add->weight;
-    virtual_bus.push(*packet_to_add);
+// output stage
+void release_kept_line(const PipelineLine* kept) {
+    if (kept->block->live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete kept->block;
+    }
 }
 
-void handle_packet_arrival(Packet* packet) {
-    pending_packets.pop();
+// parse stage, at the end: the lines the last block never got are released
+void close_line_block(Pipeline* pipeline) {
+    LineBlock* block = pipeline->block;
+    pipeline->block = NULL;
+    int unused = (block != NULL) ? PIPELINE_BLOCK_LINES - block->used_lines : 0;
+    if (unused > 0 && block->live.fetch_sub(unused, std::memory_order_acq_rel) == unused) {
+        delete block;
+    }
+}
 
-    int conn_id = packet->connection_id;
-    double last_conn_vft = connections[conn_id].virtual_finish_time;
+// scheduling link with -T: the next batch from the parse stage into pending_packets
+int take_parsed_batch(Link* link) {
+    PacketBatch* batch = (PacketBatch*)ring_pop(&link->pipeline->parsed);
+    if (batch == NULL) {
+        link->input_done = 1;
+        return 0;
+    }
+    for (int i = 0; i < batch->count; i++) link->pending_packets.push(batch->packets[i]);
+    delete batch;
+    return 1;
+}
 
-    double virtual_start = (virtual_time > last_conn_vft) ? virtual_time : last_conn_vft;
+// -T parse stage, runs on a Link of its own that owns the input and the connection table
+void parse_stage(Link* link) {
+    Pipeline* pipeline = link->parse_into;
+    while (1) {
+        PacketBatch* batch = new PacketBatch;
+        batch->count = 0;
+        while (batch->count < PIPELINE_BATCH && (!link->pending_packets.empty() || read_next_packet(link))) {
+            batch->packets[batch->count++] = link->pending_packets.front();
+            link->pending_packets.pop();
+        }
+        if (batch->count == 0) {
+            delete batch;
+            break;
+        }
+        ring_push(&pipeline->parsed, batch);
+    }
+    close_line_block(pipeline);
+    ring_push(&pipeline->parsed, NULL);
+}
 
+// -T output stage, formats on the scheduling link's output buffer
+void output_stage(Link* link) {
+    while (DepartureBatch* batch = (DepartureBatch*)ring_pop(&link->pipeline->departed)) {
+        for (int i = 0; i < batch->count; i++) output_packet(link, &batch->departures[i]);
+        delete batch;
+    }
+    PROFILE_BEGIN();
+    output_flush(link);
+    PROFILE_END(profile_output_ns);
+}
 
-    if ((packet->arrival_time <= debug_arrival_time_1  && packet->arrival_time >=  debug_arrival_time_2) && Debug == 1) {
-        printf("DEBUG: %s virtual start: %f lastconfft %f virtual time %f \n", packet->original_line, virtual_start, last_conn_vft, virtual_time);
+// One whole run: in to out through options->num_ports links, each on its own thread when there
+// are several. Adds the number of packets sent to *packets, returns 0 on success. stats_path (-s)
+// and events_path (-t) may be NULL.
+int run_trace(const Options* options, FILE* in, FILE* out, const char* stats_path, const char* events_path,
+              long long* packets) {
+    Input input;
+    input.file = in;
+    if (options->sources.empty() && !open_input(&input, options->producers > 1)) {
+        close_input(&input);
+        return 1;
+    }
+    int status = 0;
+    std::vector<Link> links(options->num_ports);
+    if (options->num_ports == 1) {
+        // -P: producer threads decode parts of the input, -m: of every source, -T: parsing and output
+        // on threads of their own
+        int num_sources = (int)options->sources.size();
+        std::vector<IngestQueue> queues(num_sources > 0 ? num_sources : options->producers > 1 ? options->producers : 0);
+        std::vector<Input> source_inputs(num_sources);
+        std::vector<Link> source_readers(num_sources);
+        for (int k = 0; k < num_sources; k++) {
+            source_inputs[k].file = fopen(options->sources[k], "rb");
+            if (source_inputs[k].file == NULL) {
+                perror(options->sources[k]);
+                status = 1;
+            } else if (!open_input(&source_inputs[k], 0)) {
+                status = 1;
+            }
+            if (status != 0) {
+                for (int i = 0; i <= k; i++) {
+                    close_input(&source_inputs[i]);
+                    if (source_inputs[i].file != NULL) fclose(source_inputs[i].file);
+                }
+                return 1;
+            }
+            init_link(&source_readers[k], options, &source_inputs[k], 0, NULL);
+        }
+        std::vector<std::thread> threads;
+        Pipeline pipeline;
+        Link parse_link;
+        Link* parser = options->pipeline ? &parse_link : &links[0];
+        init_link(&links[0], options, &input, 0, out);
+        if (options->restore_path != NULL && !restore_snapshot(&links[0], options->restore_path)) {
+            close_input(&input);
+            return 1;
+        }
+        if (options->pipeline) {
+            init_link(&parse_link, options, &input, 0, NULL);
+            parse_link.parse_into = &pipeline;
+            links[0].pipeline = &pipeline;
+        }
+        if (!queues.empty()) {
+            parser->ingest = &queues[0];
+            parser->num_ingest = (int)queues.size();
+        }
+        for (size_t k = 0; k < queues.size(); k++) {
+            if (num_sources > 0) {
+                threads.push_back(std::thread(produce_source, &source_readers[k], &queues[k]));
+            } else {
+                threads.push_back(std::thread(produce, &input, &queues, (int)k));
+            }
+        }
+        if (options->pipeline) {
+            threads.push_back(std::thread(parse_stage, &parse_link));
+            threads.push_back(std::thread(output_stage, &links[0]));
+        }
+        run_link(&links[0]);
+        for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+        parser->ingest = NULL;
+        for (size_t k = 0; k < queues.size(); k++) {
+            if (queues[k].bad_input) status = 1;
+        }
+        for (int k = 0; k < num_sources; k++) {
+            if (source_readers[k].bad_input) status = 1;
+            close_input(&source_inputs[k]);
+            fclose(source_inputs[k].file);
+        }
+        if (links[0].stopped || links[0].bad_input || parse_link.bad_input) status = 1;
+        if (options->pipeline) {
+            // the statistics name connections from the scheduling link
+            std::swap(links[0].connections, parse_link.connections);
+            std::swap(links[0].num_connections, parse_link.num_connections);
+            std::swap(links[0].connections_capacity, parse_link.connections_capacity);
+        }
+    } else {
+        // this thread reads and decodes the input once, every link takes the packets routed to it
+        // from a queue of its own
+        std::vector<IngestQueue> queues(options->num_ports);
+        std::vector<std::thread> threads;
+        for (int port = 0; port < options->num_ports; port++) {
+            FILE* tmp = tmpfile();
+            if (tmp == NULL) {
+                perror("tmpfile");
+                status = 1;
+                break;
+            }
+            init_link(&links[port], options, &input, port, tmp);
+            links[port].ingest = &queues[port];
+            links[port].num_ingest = 1;
+        }
+        if (status == 0) {
+            for (int port = 0; port < options->num_ports; port++) {
+                threads.push_back(std::thread(run_link, &links[port]));
+            }
+            Link reader;
+            init_link(&reader, options, &input, 0, NULL);
+            dispatch(&reader, &queues);
+            if (reader.bad_input) status = 1;
+        }
+        for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+        if (status == 0) merge_link_outputs(links, out);
+        for (size_t i = 0; i < links.size(); i++) {
+            if (links[i].output_file != NULL) fclose(links[i].output_file);
+        }
+    }
+    std::vector<Link*> finished;
+    for (size_t i = 0; i < links.size(); i++) {
+        *packets += links[i].departures;
+        finished.push_back(&links[i]);
     }
+    if (status == 0 && stats_path != NULL) status = write_stats(&finished[0], (int)finished.size(), stats_path);
+    if (status == 0 && events_path != NULL) status = write_events(&finished[0], (int)finished.size(), events_path);
+    close_input(&input);
+    return status;
+}
 
+void on_snapshot_signal(int sig) {
+    if (sig == SIGUSR1) {
+        snapshot_requested = 1;
+    } else {
+        stop_requested = 1;
+    }
+}
 
-    packet->virtual_start_time = virtual_start;
-    if (packet->has_weight) {
-        connections[conn_id].weight = packet->weight;
-    }else{packet->weight = connections[conn_id].weight;} //if packet does not have a specified weight, take the connection's at the time
-    packet->virtual_finish_time = virtual_start + (double)packet->length / connections[conn_id].weight;
+// -S: between two time steps, writes a snapshot if a signal asked for one or -i says it is time.
+// After SIGINT or SIGTERM the link stops once the snapshot is out.
+void snapshot_point(Link* link) {
+    const Options* options = link->options;
+    int due = snapshot_requested || stop_requested;
+    if (!due && options->snapshot_interval > 0 && ++link->time_steps % SNAPSHOT_CHECK_EVERY == 0) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        due = std::chrono::duration<double>(now - link->last_snapshot).count() >= options->snapshot_interval;
+    }
+    if (!due) return;
+    snapshot_requested = 0;
+    int ok = write_snapshot(link, options->snapshot_path);
+    link->last_snapshot = std::chrono::steady_clock::now();
+    if (stop_requested) {
+        link->stopped = 1;
+        if (ok) fprintf(stderr, "stopped, resume with -R %s\n", options->snapshot_path);
+    }
+}
 
-    if ((packet->arrival_time <= debug_arrival_time_1  && packet->arrival_time >=  debug_arrival_time_2) && Debug == 1) {
-        printf("DEBUG: %s Virtual End %f length %d weight %lf \n", packet->original_line, packet->virtual_finish_time, packet->length, connections[packet->connection_id].weight);
+// Everything the link needs to carry on from the current time step: the output is flushed so that
+// the snapshot can record where it ends. Written to path.tmp and renamed, an interrupted write never
+// replaces a good snapshot. Returns 0 on failure.
+int write_snapshot(Link* link, const char* path) {
+    output_flush(link);
+    const Input* input = link->input;
+    int binary_input = (input->trace_header != NULL);
+    std::vector<Packet> pending;
+    std::queue<Packet> waiting = link->pending_packets; // the lookahead, one packet
+    while (!waiting.empty()) {
+        pending.push_back(waiting.front());
+        waiting.pop();
+    }
+    // lines of the packets still to be sent, a binary trace has all of its text in the input
+    std::vector<unsigned long long> cookies;
+    if (!binary_input) {
+        link->scheduler.held_cookies(&cookies);
+        for (size_t i = 0; i < pending.size(); i++) cookies.push_back(pending[i].cookie);
+    }
+    std::vector<char> scheduler_state;
+    link->scheduler.save(&scheduler_state);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.binary_input = binary_input;
+    header.discipline = link->options->discipline;
+    header.num_classes = (int)link->options->class_defs.size();
+    header.binary_output = link->options->binary_output;
+    header.stats_format = link->options->stats_format;
+    header.input_size = link->input_mapped ? (long long)link->input_size : -1;
+    header.input_offset = binary_input ? (long long)link->input_pos : link->input_base + (long long)link->input_pos;
+    header.output_offset = link->output_written;
+    header.departures = link->departures;
+    header.first_arrival = link->first_arrival;
+    header.last_finish = link->last_finish;
+    header.arrival_clock = link->arrival_clock;
+    header.next_appearance_order = link->next_appearance_order;
+    header.input_done = link->input_done;
+    header.num_connections = link->num_connections;
+    header.num_pending = (int)pending.size();
+    header.num_chunks = (int)link->arena_chunks.size();
+    header.current_arena_chunk = link->current_arena_chunk;
+    header.num_free_chunks = (int)link->free_arena_chunks.size();
+    header.num_lines = (int)cookies.size();
+    header.flow_stats_count = link->flow_stats_count;
+    header.has_histogram = (link->delay_histogram != NULL);
+    header.reclaim = link->reclaim;
+    header.num_idle_connections = (int)link->idle_connections.size();
+    header.num_kept_weights = link->num_kept_weights;
+    header.scheduler_size = (long long)scheduler_state.size();
+
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL) {
+        perror(tmp_path.c_str());
+        return 0;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(link->connections, sizeof(Connection), link->num_connections, file);
+    if (!pending.empty()) fwrite(&pending[0], sizeof(Packet), pending.size(), file);
+    for (size_t i = 0; i < link->arena_chunks.size(); i++) {
+        SnapshotChunk chunk;
+        chunk.used = link->arena_chunks[i].used;
+        chunk.live = link->arena_chunks[i].live;
+        fwrite(&chunk, sizeof(chunk), 1, file);
     }
-    connections[conn_id].virtual_finish_time = packet->virtual_finish_time;
+    if (!link->free_arena_chunks.empty()) fwrite(&link->free_arena_chunks[0], sizeof(int), link->free_arena_chunks.size(), file);
+    for (size_t i = 0; i < cookies.size(); i++) {
+        SnapshotLine line = {0, 0};
+        line.line_ref = (unsigned int)cookies[i];
+        const char* text = arena_line(link, line.line_ref);
+        line.len = (int)strlen(text);
+        fwrite(&line, sizeof(line), 1, file);
+        fwrite(text, 1, (size_t)line.len, file);
+    }
+    fwrite(link->flow_stats, sizeof(FlowStats), link->flow_stats_count, file);
+    if (link->delay_histogram != NULL) fwrite(link->delay_histogram, sizeof(long long), DELAY_BUCKETS, file);
+    if (link->reclaim) {
+        fwrite(link->connection_use, sizeof(ConnectionUse), link->num_connections, file);
+        for (size_t i = 0; i < link->idle_connections.size(); i++) fwrite(&link->idle_connections[i], sizeof(int), 1, file);
+        for (unsigned int i = 0; link->num_kept_weights > 0 && i <= link->kept_weights_mask; i++) {
+            if (link->kept_weights[i].used) fwrite(&link->kept_weights[i], sizeof(KeptWeight), 1, file);
+        }
+    }
+    fwrite(&scheduler_state[0], 1, scheduler_state.size(), file);
+    int ok = (fflush(file) == 0 && !ferror(file));
+#ifndef _WIN32
+    ok = ok && fsync(fileno(file)) == 0;
+#endif
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path) != 0) {
+        perror(path);
+        remove(tmp_path.c_str());
+        return 0;
+    }
+    return 1;
+}
 
-    ready_queue.push(*packet);
+// copies the next size bytes of a snapshot to dst, 0 if it is too short
+int read_snapshot_part(const char** p, const char* end, void* dst, size_t size) {
+    if ((size_t)(end - *p) < size) return 0;
+    memcpy(dst, *p, size);
+    *p += size;
+    return 1;
 }
-int main() {
-    parse_file();
-    while (!pending_packets.empty() || !ready_queue.empty()) {
-        if (Debug == 1) {
-            printf("ready_queue.size() = %lld \n", ready_queue.size());
+
+// -R: puts a freshly initialised link back into the state of a snapshot of the same run (same
+// input and options), moves the input on to where the snapshot was taken and, when stdout is the
+// interrupted run's output file, cuts it back to what the snapshot had written. Returns 0 on failure.
+int restore_snapshot(Link* link, const char* path) {
+    Input file_input;
+    file_input.file = fopen(path, "rb");
+    if (file_input.file == NULL) {
+        perror(path);
+        return 0;
+    }
+    // read like an input: mapped when possible, the whole of it either way
+    int opened = open_input(&file_input, 1) && file_input.trace_header == NULL;
+    fclose(file_input.file);
+    const char* p = file_input.shared;
+    const char* end = p + file_input.shared_size;
+    const Options* options = link->options;
+    const Input* input = link->input;
+    int binary_input = (input->trace_header != NULL);
+    SnapshotHeader header;
+    int ok = opened && p != NULL && read_snapshot_part(&p, end, &header, sizeof(header)) &&
+             memcmp(header.magic, SNAPSHOT_MAGIC, 8) == 0 && header.version == SNAPSHOT_VERSION;
+    if (!ok) {
+        fprintf(stderr, "%s is not a snapshot, or one from an incompatible build\n", path);
+        close_input(&file_input);
+        return 0;
+    }
+    if (header.binary_input != binary_input || header.discipline != options->discipline ||
+        header.num_classes != (int)options->class_defs.size() || header.binary_output != options->binary_output ||
+        header.stats_format != options->stats_format || header.reclaim != link->reclaim ||
+        (header.input_size != -1 && link->input_mapped && header.input_size != (long long)link->input_size)) {
+        fprintf(stderr, "%s was taken with other options or another input\n", path);
+        close_input(&file_input);
+        return 0;
+    }
+
+    ok = header.num_connections >= 0 && header.num_pending >= 0 && header.num_chunks >= 0 && header.num_free_chunks >= 0 &&
+         header.num_lines >= 0 && header.flow_stats_count >= 0 && header.num_idle_connections >= 0 &&
+         header.num_kept_weights >= 0 && header.scheduler_size >= 0 &&
+         header.current_arena_chunk >= -1 && header.current_arena_chunk < header.num_chunks;
+    link->connections_capacity = std::max(header.num_connections, INITIAL_CONNECTION_CAPACITY);
+    link->connections = (Connection*)malloc(link->connections_capacity * sizeof(Connection));
+    ok = ok && read_snapshot_part(&p, end, link->connections, header.num_connections * sizeof(Connection));
+    link->num_connections = ok ? header.num_connections : 0;
+    // sized for all of them at once, the load factor stays at most 1/2 as find_or_create_connection() keeps it
+    unsigned int table_size = INITIAL_CONNECTION_CAPACITY * 2;
+    while ((unsigned int)(link->num_connections + 1) * 2 > table_size) table_size *= 2;
+    build_conn_table(link, table_size);
+    for (int i = 0; ok && i < header.num_pending; i++) {
+        Packet packet;
+        ok = read_snapshot_part(&p, end, &packet, sizeof(packet));
+        if (ok) link->pending_packets.push(packet);
+    }
+    for (int i = 0; ok && i < header.num_chunks; i++) {
+        SnapshotChunk saved = {0, 0};
+        ok = read_snapshot_part(&p, end, &saved, sizeof(saved)) && saved.used >= 0 && saved.used <= ARENA_CHUNK_SIZE;
+        ArenaChunk chunk;
+        chunk.data = (char*)malloc(ARENA_CHUNK_SIZE);
+        chunk.used = saved.used;
+        chunk.live = saved.live;
+        link->arena_chunks.push_back(chunk);
+    }
+    link->current_arena_chunk = header.current_arena_chunk;
+    for (int i = 0; ok && i < header.num_free_chunks; i++) {
+        int chunk_idx;
+        ok = read_snapshot_part(&p, end, &chunk_idx, sizeof(chunk_idx)) && chunk_idx >= 0 && chunk_idx < header.num_chunks;
+        if (ok) link->free_arena_chunks.push_back(chunk_idx);
+    }
+    // every line goes back to where it was, the cookies in the scheduler still point at them
+    for (int i = 0; ok && i < header.num_lines; i++) {
+        SnapshotLine line = {0, 0};
+        ok = read_snapshot_part(&p, end, &line, sizeof(line));
+        unsigned int chunk_idx = line.line_ref >> ARENA_CHUNK_BITS;
+        unsigned int offset = line.line_ref & (ARENA_CHUNK_SIZE - 1);
+        ok = ok && chunk_idx < (unsigned int)header.num_chunks && line.len >= 0 && line.len < MAX_LINE_LEN &&
+             offset + (unsigned int)line.len < ARENA_CHUNK_SIZE;
+        ok = ok && read_snapshot_part(&p, end, link->arena_chunks[chunk_idx].data + offset, (size_t)line.len);
+        if (ok) link->arena_chunks[chunk_idx].data[offset + line.len] = 0;
+    }
+    if (ok && header.flow_stats_count > 0) {
+        flow_stats_at(link, header.flow_stats_count - 1);
+        ok = read_snapshot_part(&p, end, link->flow_stats, header.flow_stats_count * sizeof(FlowStats));
+    }
+    if (ok && header.has_histogram) {
+        ok = link->delay_histogram != NULL && read_snapshot_part(&p, end, link->delay_histogram, DELAY_BUCKETS * sizeof(long long));
+    }
+    if (ok && link->reclaim) {
+        link->connection_use = (ConnectionUse*)malloc(link->connections_capacity * sizeof(ConnectionUse));
+        ok = read_snapshot_part(&p, end, link->connection_use, header.num_connections * sizeof(ConnectionUse));
+        for (int i = 0; ok && i < header.num_idle_connections; i++) {
+            int id;
+            ok = read_snapshot_part(&p, end, &id, sizeof(id)) && id >= 0 && id < header.num_connections;
+            if (ok) link->idle_connections.push_back(id);
         }
-        long long next_arrival_event_time = (!pending_packets.empty()) ? pending_packets.front().arrival_time : LLONG_MAX;
-        if (ready_queue.empty() && next_arrival_event_time == LLONG_MAX) {
-            break;
+        for (int i = 0; ok && i < header.num_kept_weights; i++) {
+            KeptWeight kept;
+            ok = read_snapshot_part(&p, end, &kept, sizeof(kept));
+            if (ok) keep_weight(link, &kept.key, kept.weight);
+        }
+    }
+    ok = ok && header.scheduler_size == (long long)(end - p) && link->scheduler.load(p, (size_t)header.scheduler_size);
+    close_input(&file_input);
+    if (!ok) {
+        fprintf(stderr, "%s is damaged or from a build with other options\n", path);
+        return 0;
+    }
+    link->departures = header.departures;
+    link->first_arrival = header.first_arrival;
+    link->last_finish = header.last_finish;
+    link->arrival_clock = header.arrival_clock;
+    link->next_appearance_order = header.next_appearance_order;
+    link->input_done = header.input_done;
+    link->output_written = header.output_offset;
+
+    // the input carries on after the lookahead packet
+    long long offset = header.input_offset;
+    if (binary_input) {
+        ok = offset >= 0 && offset <= input->trace_header->num_records;
+    } else if (link->input_mapped) {
+        ok = offset >= 0 && offset <= (long long)link->input_size;
+    } else {
+        while (offset > (long long)link->input_size && link->input_size > 0) {
+            offset -= (long long)link->input_size;
+            link->input_base += (long long)link->input_size;
+            link->input_size = fread(link->input_block, 1, INPUT_BLOCK_SIZE, input->file);
         }
+        ok = offset >= 0 && offset <= (long long)link->input_size;
+    }
+    if (!ok) {
+        fprintf(stderr, "the input is shorter than the one %s was taken from\n", path);
+        return 0;
+    }
+    link->input_pos = (size_t)offset;
+#ifndef _WIN32
+    // > out gives an empty file that the rest goes into, >> out the interrupted run's output that may
+    // have grown past the snapshot
+    struct stat st;
+    int fd = fileno(link->output_file);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > header.output_offset) {
+        if (ftruncate(fd, (off_t)header.output_offset) != 0 || lseek(fd, (off_t)header.output_offset, SEEK_SET) < 0) {
+            perror("output");
+            return 0;
+        }
+    }
+#endif
+    return 1;
+}
 
-        // Virtual and Real time progression
-        progress_real_time(next_arrival_event_time);
-        progress_virtual_time(next_arrival_event_time);
+// -t: each link's scheduler events to events_path, or events_path.<port> with several links
+int write_events(Link* const* links, int num_links, const char* events_path) {
+#if WFQ_TRACE
+    for (int l = 0; l < num_links; l++) {
+        std::string path = events_path;
+        if (num_links > 1) path += "." + std::to_string(links[l]->port);
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == NULL || wfq_trace_write(links[l]->scheduler.trace_ring(), file) != 0 || fclose(file) != 0) {
+            perror(path.c_str());
+            return 1;
+        }
+    }
+    return 0;
+#else
+    (void)links;
+    (void)num_links;
+    (void)events_path;
+    return 1; // main() rejects -t in these builds
+#endif
+}
 
-        if (current_time == DBL_MAX) {
-            break;
+// every link's output is in start time order, merge them by start time and then port
+void merge_link_outputs(std::vector<Link>& links, FILE* out) {
+    size_t n = links.size();
+    int binary = links[0].options->binary_output;
+    size_t item_size = binary ? sizeof(OutputRecord) : MAX_LINE_LEN + 32;
+    std::vector<char> items(n * item_size);
+    std::vector<long long> keys(n);
+    std::vector<int> has_item(n, -1); // -1 = next item not read yet, 0 = link done
+    for (size_t i = 0; i < n; i++) rewind(links[i].output_file);
+    std::vector<char> merged(OUTPUT_BUFFER_SIZE);
+    size_t merged_used = 0;
+    while (1) {
+        int best = -1;
+        for (size_t i = 0; i < n; i++) {
+            char* item = &items[i * item_size];
+            if (has_item[i] == -1) {
+                if (binary) {
+                    has_item[i] = fread(item, sizeof(OutputRecord), 1, links[i].output_file) == 1;
+                    if (has_item[i]) keys[i] = ((OutputRecord*)item)->start_time;
+                } else {
+                    has_item[i] = fgets(item, (int)item_size, links[i].output_file) != NULL;
+                    if (has_item[i]) keys[i] = atoll(item);
+                }
+            }
+            if (has_item[i] && (best == -1 || keys[i] < keys[best])) best = (int)i;
         }
+        if (best == -1) break;
+        char* item = &items[best * item_size];
+        size_t len = binary ? sizeof(OutputRecord) : strlen(item);
+        if (merged_used + len > merged.size()) {
+            fwrite(&merged[0], 1, merged_used, out);
+            merged_used = 0;
+        }
+        memcpy(&merged[merged_used], item, len);
+        merged_used += len;
+        has_item[best] = -1;
+    }
+    fwrite(&merged[0], 1, merged_used, out);
+    fflush(out);
+}
 
+// -B: every trace named in list (one path per line) or, if list is a directory, every file in it,
+// each run on its own with the same options. The output of trace x goes to output_dir/x.out and
+// one line of timing per trace to output_dir/timing.txt, in list order. With -s the statistics
+// of trace x go to output_dir/x.stats.csv (or .json), with -t its events to output_dir/x.events.
+// Returns the number of traces that failed.
+int run_batch(const Options* options, const char* list, const char* output_dir, int num_workers) {
+    std::vector<BatchJob> jobs;
+    std::vector<std::string> paths;
+#ifndef _WIN32
+    DIR* dir = opendir(list);
+    if (dir != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') paths.push_back(std::string(list) + "/" + entry->d_name);
+        }
+        closedir(dir);
+        std::sort(paths.begin(), paths.end());
+    } else
+#endif
+    {
+        FILE* file = fopen(list, "r");
+        if (file == NULL) {
+            perror(list);
+            return 1;
+        }
+        char line[4096];
+        while (fgets(line, sizeof(line), file)) {
+            size_t len = strcspn(line, "\r\n");
+            if (len > 0) paths.push_back(std::string(line, len));
+        }
+        fclose(file);
+    }
 
-    // }
+    for (size_t i = 0; i < paths.size(); i++) {
+        BatchJob job;
+        job.path = paths[i];
+        size_t slash = job.path.find_last_of('/');
+        std::string base = std::string(output_dir) + "/" + job.path.substr(slash == std::string::npos ? 0 : slash + 1);
+        job.output_path = base + ".out";
+        job.stats_path = base + (options->stats_format == STATS_JSON ? ".stats.json" : ".stats.csv");
+        job.events_path = base + ".events";
+        for (size_t k = 0; k < jobs.size(); k++) {
+            if (jobs[k].output_path == job.output_path) {
+                fprintf(stderr, "%s and %s would both write %s\n", jobs[k].path.c_str(), job.path.c_str(), job.output_path.c_str());
+                return 1;
+            }
+        }
+        job.size = 0;
+#ifndef _WIN32
+        struct stat st;
+        if (stat(job.path.c_str(), &st) == 0) job.size = (long long)st.st_size;
+#endif
+        job.ok = 0;
+        job.packets = 0;
+        job.wall_s = 0;
+        jobs.push_back(job);
+    }
 
-    if (should_remove_from_virtual_bus) {
-        remove_from_virtual_bus();
-        should_remove_from_virtual_bus = 0;
+    // deal the traces out largest first, so the long ones start early and the short ones fill in
+    std::vector<int> order(jobs.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+    std::stable_sort(order.begin(), order.end(), [&jobs](int a, int b) { return jobs[a].size > jobs[b].size; });
+    if (num_workers > (int)jobs.size()) num_workers = (int)jobs.size();
+    if (num_workers < 1) num_workers = 1;
+    std::vector<BatchQueue> queues(num_workers);
+    for (size_t i = 0; i < order.size(); i++) queues[i % num_workers].jobs.push_back(order[i]);
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < num_workers; w++) {
+        workers.push_back(std::thread(batch_worker, &jobs, &queues, w, options));
     }
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
 
-     //move packet from wait for virtual to virtual if needed
-    if (!wait_for_virtual_bus.empty() && wait_for_virtual_bus.top().virtual_start_time <= virtual_time + EPSILON) {
-        Packet packet_to_move = wait_for_virtual_bus.top();
-        add_to_virtual_bus(&packet_to_move);
-        wait_for_virtual_bus.pop();
+    std::string timing_path = std::string(output_dir) + "/timing.txt";
+    FILE* timing = fopen(timing_path.c_str(), "w");
+    if (timing == NULL) {
+        perror(timing_path.c_str());
+        return 1;
     }
+    int failures = 0;
+    fprintf(timing, "# trace packets wall_s Mpkt/s status\n");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const BatchJob* job = &jobs[i];
+        failures += !job->ok;
+        fprintf(timing, "%s %lld %.6f %.3f %s\n", job->path.c_str(), job->packets, job->wall_s,
+                job->wall_s > 0 ? job->packets / job->wall_s / 1e6 : 0.0, job->ok ? "ok" : "FAILED");
+    }
+    fclose(timing);
+    return failures;
+}
 
-    if (current_time >= next_departure_time && is_packet_on_bus ==  1) {
-        is_packet_on_bus = 0;
+void batch_worker(std::vector<BatchJob>* jobs, std::vector<BatchQueue>* queues, int self, const Options* options) {
+    int n = (int)queues->size();
+    while (1) {
+        int job_idx = -1;
+        {
+            BatchQueue* own = &(*queues)[self];
+            std::lock_guard<std::mutex> guard(own->lock);
+            if (!own->jobs.empty()) {
+                job_idx = own->jobs.front();
+                own->jobs.pop_front();
+            }
+        }
+        for (int k = 1; k < n && job_idx == -1; k++) {
+            BatchQueue* victim = &(*queues)[(self + k) % n];
+            std::lock_guard<std::mutex> guard(victim->lock);
+            if (!victim->jobs.empty()) {
+                job_idx = victim->jobs.back();
+                victim->jobs.pop_back();
+            }
+        }
+        if (job_idx == -1) return; // nothing is ever added, so every queue being empty means done
+
+        BatchJob* job = &(*jobs)[job_idx];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        FILE* in = fopen(job->path.c_str(), "rb");
+        FILE* out = fopen(job->output_path.c_str(), "wb");
+        if (in == NULL || out == NULL) {
+            perror(in == NULL ? job->path.c_str() : job->output_path.c_str());
+        } else {
+            const char* stats_path = (options->stats_format != STATS_OFF) ? job->stats_path.c_str() : NULL;
+            const char* events_path = options->event_trace ? job->events_path.c_str() : NULL;
+            job->ok = run_trace(options, in, out, stats_path, events_path, &job->packets) == 0;
+        }
+        if (in != NULL) fclose(in);
+        if (out != NULL) fclose(out);
+        job->wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     }
-    // Process all packets that have arrived by this current_time
-    while (!pending_packets.empty() && pending_packets.front().arrival_time <= current_time) {
-        Packet packet = pending_packets.front();
-        // Find or create connection
-        packet.connection_id = find_or_create_connection(packet.src_ip, packet.src_port,
-                                                         packet.dst_ip, packet.dst_port,
-                                                         packet.appearance_order);
-        handle_packet_arrival(&packet);
+}
 
-        if (packet.virtual_start_time != virtual_time) {
-            wait_for_virtual_bus.push(packet);
-        }else {
-            add_to_virtual_bus(&packet);
+int main(int argc, char** argv) {
+    Options options;
+    int convert = 0;
+    const char* batch_list = NULL;
+    const char* batch_output_dir = NULL;
+    const char* stats_path = NULL;
+    const char* events_path = NULL;
+    int batch_workers = (int)std::thread::hardware_concurrency();
+    int bad_usage = 0;
+    for (int i = 1; i < argc && !bad_usage; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            options.binary_output = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            convert = 1;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            options.num_ports = atoi(argv[++i]);
+            bad_usage = options.num_ports < 1;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "hash") == 0) options.route_mode = ROUTE_HASH;
+            else if (strcmp(argv[i], "dst_port") == 0) options.route_mode = ROUTE_DST_PORT;
+            else if (strcmp(argv[i], "dst_ip") == 0) options.route_mode = ROUTE_DST_IP;
+            else bad_usage = 1;
+        } else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            options.discipline = DISCIPLINE_HWFQ;
+            read_class_config(&options, argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "wfq") == 0) options.discipline = DISCIPLINE_WFQ;
+            else if (strcmp(argv[i], "scfq") == 0) options.discipline = DISCIPLINE_SCFQ;
+            else if (strcmp(argv[i], "wf2q+") == 0) options.discipline = DISCIPLINE_WF2QPLUS;
+            else if (strcmp(argv[i], "drr") == 0) options.discipline = DISCIPLINE_DRR;
+            else bad_usage = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+            size_t len = strlen(stats_path);
+            options.stats_format = (len >= 5 && strcmp(stats_path + len - 5, ".json") == 0) ? STATS_JSON : STATS_CSV;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            events_path = argv[++i];
+            options.event_trace = 1;
+        } else if (strcmp(argv[i], "-T") == 0) {
+            options.pipeline = 1;
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            options.producers = atoi(argv[++i]);
+            bad_usage = options.producers < 1;
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            options.sources.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            options.snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            options.snapshot_interval = atof(argv[++i]);
+            bad_usage = options.snapshot_interval <= 0;
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            options.restore_path = argv[++i];
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            batch_list = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            batch_output_dir = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            batch_workers = atoi(argv[++i]);
+            bad_usage = batch_workers < 1;
+        } else {
+            bad_usage = 1;
+        }
+    }
+    if (bad_usage || (batch_list != NULL) != (batch_output_dir != NULL) || (convert && batch_list != NULL) ||
+        ((options.producers > 1 || options.pipeline || !options.sources.empty()) && options.num_ports > 1) ||
+        (!options.sources.empty() && (options.producers > 1 || batch_list != NULL || convert)) ||
+        (options.snapshot_interval > 0 && options.snapshot_path == NULL) ||
+        ((options.snapshot_path != NULL || options.restore_path != NULL) &&
+         (options.producers > 1 || !options.sources.empty() || options.pipeline || options.num_ports > 1 ||
+          batch_list != NULL || convert))) {
+        fprintf(stderr, "usage: %s [-b] [-p ports | [-P producers] [-T]] [-r hash|dst_port|dst_ip] [-d wfq|scfq|wf2q+|drr]\n"
+                        "          [-h class_config] [-s stats.csv|stats.json] [-t events] < trace\n"
+                        "       %s [-b] [-T] [-d ...] [-h ...] [-s ...] [-t ...] -m trace -m trace ...\n"
+                        "       %s [-b] [-d ...] [-h ...] [-s ...] [-t ...] [-S snapshot [-i seconds]] [-R snapshot] < trace\n"
+                        "       %s [options as above] -B trace_list|trace_dir -o output_dir [-j threads]\n"
+                        "       %s -c < text_trace > binary_trace\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    if (options.event_trace && !WFQ_TRACE) {
+        fprintf(stderr, "-t needs a build with -DWFQ_TRACE=1\n");
+        return 1;
+    }
+#ifndef _WIN32
+    if (options.snapshot_path != NULL) {
+        // SIGUSR1 takes a snapshot, SIGINT and SIGTERM take one and stop. SA_RESTART keeps a read of
+        // the input from failing when a signal comes in.
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_snapshot_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+    }
+#endif
+    PROFILE_START();
+    if (batch_list != NULL) {
+        int failures = run_batch(&options, batch_list, batch_output_dir, batch_workers);
+        PROFILE_REPORT();
+        return failures ? 1 : 0;
+    }
+    if (convert) {
+        options.num_ports = 1;
+        Input input;
+        input.file = stdin;
+        if (!open_input(&input, 0)) {
+            return 1;
+        }
+        if (input.trace_header != NULL) {
+            fprintf(stderr, "input is already a binary trace\n");
+            return 1;
         }
+        Link link;
+        init_link(&link, &options, &input, 0, stdout);
+        return convert_trace(&link);
     }
+    long long packets = 0;
+    if (run_trace(&options, stdin, stdout, stats_path, events_path, &packets) != 0) {
+        return 1;
+    }
+    PROFILE_REPORT();
+    return 0;
+}
+
+
+unsigned int hash_connection(const Connection* c) {
+    unsigned long long h = ((unsigned long long)c->src_ip << 32) | c->dst_ip;
+    h ^= ((unsigned long long)c->src_port << 16 | c->dst_port) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned int)h;
+}
 
-    // schedule a packet if it is time to do so
-    if (!ready_queue.empty() && next_departure_time <= current_time && is_packet_on_bus == 0){
-        schedule_next_packet();
+// doubles the hash table and reinserts every connection, keeps load factor <= 1/2
+void grow_conn_table(Link* link) {
+    build_conn_table(link, link->conn_table ? (link->conn_table_mask + 1) * 2 : INITIAL_CONNECTION_CAPACITY * 2);
+}
+
+// a table of size slots (a power of two, more than num_connections) holding every connection
+void build_conn_table(Link* link, unsigned int size) {
+    free(link->conn_table);
+    link->conn_table = (int*)malloc(size * sizeof(int));
+    memset(link->conn_table, 0xff, size * sizeof(int));
+    link->conn_table_mask = size - 1;
+    for (int i = 0; i < link->num_connections; i++) {
+        unsigned int slot = hash_connection(&link->connections[i]) & link->conn_table_mask;
+        while (link->conn_table[slot] != -1) slot = (slot + 1) & link->conn_table_mask;
+        link->conn_table[slot] = i;
     }
+}
 
+// *created is set to whether key is new
+int find_or_create_connection(Link* link, const Connection* key, int* created) {
+    if ((unsigned int)(link->num_connections + 1) * 2 > link->conn_table_mask + 1) {
+        grow_conn_table(link);
+    }
 
+    // Look for existing connection
+    unsigned int slot = hash_connection(key) & link->conn_table_mask;
+    while (link->conn_table[slot] != -1) {
+        const Connection* c = &link->connections[link->conn_table[slot]];
+        if (c->src_ip == key->src_ip && c->dst_ip == key->dst_ip &&
+            c->src_port == key->src_port && c->dst_port == key->dst_port) {
+            *created = 0;
+            return link->conn_table[slot];
+        }
+        slot = (slot + 1) & link->conn_table_mask;
+    }
+    *created = 1;
+
+    // Reuse an idle connection's id or create a new connection
+    int id = link->reclaim ? reclaim_connection(link) : -1;
+    if (id != -1) {
+        // taking the old key out may have moved others, look for the free slot again
+        slot = hash_connection(key) & link->conn_table_mask;
+        while (link->conn_table[slot] != -1) slot = (slot + 1) & link->conn_table_mask;
+    } else {
+        if (link->num_connections >= link->connections_capacity) {
+            link->connections_capacity = link->connections_capacity ? link->connections_capacity * 2 : INITIAL_CONNECTION_CAPACITY;
+            link->connections = (Connection*)realloc(link->connections, link->connections_capacity * sizeof(Connection));
+            if (link->reclaim) {
+                link->connection_use = (ConnectionUse*)realloc(link->connection_use, link->connections_capacity * sizeof(ConnectionUse));
+            }
+        }
+        id = link->num_connections++;
+        if (link->reclaim) {
+            link->connection_use[id].in_flight = 0;
+            link->connection_use[id].idle_listed = 0;
+        }
+    }
+    link->conn_table[slot] = id;
+    link->connections[id] = *key; // the scheduler creates the flow with weight 1 on its first packet
 
+    return id;
+}
+
+// takes id out of conn_table. Later entries of the probe run move back into the hole unless that
+// would put them before their home slot, so every lookup still finds them.
+void remove_from_conn_table(Link* link, int id) {
+    unsigned int mask = link->conn_table_mask;
+    unsigned int slot = hash_connection(&link->connections[id]) & mask;
+    while (link->conn_table[slot] != id) slot = (slot + 1) & mask;
+    unsigned int hole = slot;
+    while (link->conn_table[slot = (slot + 1) & mask] != -1) {
+        int other = link->conn_table[slot];
+        unsigned int home = hash_connection(&link->connections[other]) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            link->conn_table[hole] = other;
+            hole = slot;
+        }
     }
+    link->conn_table[hole] = -1;
+}
 
-    return 0;
+// The oldest idle connection, out of the table and with a fresh flow in the scheduler, -1 if none is
+// idle. A connection whose flow is still ahead of the virtual time (or on the GPS bus) goes to the
+// back, one that got packets again leaves the list until they are sent.
+int reclaim_connection(Link* link) {
+    for (int tries = 0; tries < RECLAIM_TRIES && !link->idle_connections.empty(); tries++) {
+        int id = link->idle_connections.front();
+        link->idle_connections.pop_front();
+        ConnectionUse* use = &link->connection_use[id];
+        if (use->in_flight > 0) {
+            use->idle_listed = 0;
+            continue;
+        }
+        if (!link->scheduler.flow_idle(id)) {
+            link->idle_connections.push_back(id);
+            continue;
+        }
+        use->idle_listed = 0;
+        double weight = link->scheduler.reset_flow(id);
+        if (weight != 1) keep_weight(link, &link->connections[id], weight);
+        remove_from_conn_table(link, id);
+        return id;
+    }
+    return -1;
 }
 
+// remembers the weight of a reclaimed connection, the table doubles at load factor 1/2
+void keep_weight(Link* link, const Connection* key, double weight) {
+    if ((unsigned int)(link->num_kept_weights + 1) * 2 > link->kept_weights_mask + 1) {
+        KeptWeight* old = link->kept_weights;
+        unsigned int old_size = old ? link->kept_weights_mask + 1 : 0;
+        unsigned int new_size = old ? old_size * 2 : INITIAL_CONNECTION_CAPACITY;
+        link->kept_weights = (KeptWeight*)calloc(new_size, sizeof(KeptWeight));
+        link->kept_weights_mask = new_size - 1;
+        link->num_kept_weights = 0;
+        for (unsigned int i = 0; i < old_size; i++) {
+            if (old[i].used) keep_weight(link, &old[i].key, old[i].weight);
+        }
+        free(old);
+    }
+    unsigned int slot = hash_connection(key) & link->kept_weights_mask;
+    while (link->kept_weights[slot].used) slot = (slot + 1) & link->kept_weights_mask;
+    link->kept_weights[slot].key = *key;
+    link->kept_weights[slot].used = 1;
+    link->kept_weights[slot].weight = weight;
+    link->num_kept_weights++;
+}
 
-int find_or_create_connection(const char* src_ip, int src_port, const char* dst_ip, int dst_port, int appearance_order) {
-    // Look for existing connection
-    for (int i = 0; i < num_connections; i++) {
-        if (strcmp(connections[i].conn.src_ip, src_ip) == 0 &&
-            connections[i].conn.src_port == src_port &&
-            strcmp(connections[i].conn.dst_ip, dst_ip) == 0 &&
-            connections[i].conn.dst_port == dst_port) {
-            return i;
+// the weight kept for key, which is forgotten, NO_WEIGHT if there is none
+double take_kept_weight(Link* link, const Connection* key) {
+    if (link->num_kept_weights == 0) return NO_WEIGHT;
+    unsigned int mask = link->kept_weights_mask;
+    unsigned int slot = hash_connection(key) & mask;
+    while (link->kept_weights[slot].used) {
+        const Connection* c = &link->kept_weights[slot].key;
+        if (c->src_ip == key->src_ip && c->dst_ip == key->dst_ip && c->src_port == key->src_port && c->dst_port == key->dst_port) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (!link->kept_weights[slot].used) return NO_WEIGHT;
+    double weight = link->kept_weights[slot].weight;
+    link->num_kept_weights--;
+    // closes the hole as remove_from_conn_table() does
+    unsigned int hole = slot;
+    while (link->kept_weights[slot = (slot + 1) & mask].used) {
+        unsigned int home = hash_connection(&link->kept_weights[slot].key) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            link->kept_weights[hole] = link->kept_weights[slot];
+            hole = slot;
+        }
+    }
+    link->kept_weights[hole].used = 0;
+    return weight;
+}
+
+// a packet of connection id has been sent, the connection may be idle now
+void connection_sent(Link* link, int id) {
+    ConnectionUse* use = &link->connection_use[id];
+    if (--use->in_flight == 0 && !use->idle_listed) {
+        use->idle_listed = 1;
+        link->idle_connections.push_back(id);
+    }
+}
+
+// the decoders below work in place on the input and return where they stopped
+const char* parse_uint(const char* p, const char* end, long long* value) {
+    long long v = 0;
+    while (p < end && *p == ' ') p++;
+    int negative = (p < end && *p == '-');
+    if (negative) p++;
+    while (p < end && (unsigned)(*p - '0') < 10) {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    while (p < end && *p != ' ') p++; // like atoll, ignore whatever trails the digits
+    *value = negative ? -v : v;
+    return p;
+}
+
+const char* parse_ipv4(const char* p, const char* end, unsigned int* addr) {
+    unsigned int a = 0, octet = 0;
+    while (p < end && *p == ' ') p++;
+    while (p < end && *p != ' ') {
+        if (*p == '.') {
+            a = (a << 8) | (octet & 0xff);
+            octet = 0;
+        } else {
+            octet = octet * 10 + (unsigned int)(*p - '0');
         }
+        p++;
     }
+    *addr = (a << 8) | (octet & 0xff);
+    return p;
+}
 
-    // Create new connection
-    if (num_connections >= MAX_CONNECTIONS) {
-        fprintf(stderr, "Too many connections\n");
+// digits[.digits] is exact as long as the mantissa fits in 2^53 and the scale is a power of
+// ten up to 1e22 (one correctly rounded division), anything else goes through atof
+const char* parse_weight(const char* p, const char* end, double* weight) {
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    while (p < end && *p == ' ') p++;
+    const char* start = p;
+    unsigned long long mantissa = 0;
+    int digits = 0, frac_digits = 0, seen_dot = 0;
+    for (; p < end && *p != ' '; p++) {
+        if ((unsigned)(*p - '0') < 10) {
+            mantissa = mantissa * 10 + (unsigned)(*p - '0');
+            digits++;
+            frac_digits += seen_dot;
+        } else if (*p == '.' && !seen_dot) {
+            seen_dot = 1;
+        } else {
+            break;
+        }
+    }
+    if ((p < end && *p != ' ') || digits == 0 || digits > 15 || frac_digits > 22) {
+        char buf[MAX_LINE_LEN];
+        while (p < end && *p != ' ') p++;
+        size_t n = (size_t)(p - start);
+        memcpy(buf, start, n);
+        buf[n] = 0;
+        *weight = atof(buf);
+        return p;
+    }
+    *weight = (double)mantissa / pow10[frac_digits];
+    return p;
+}
+
+int route_port(const Options* options, const Connection* key) {
+    switch (options->route_mode) {
+        case ROUTE_DST_PORT: return key->dst_port % options->num_ports;
+        case ROUTE_DST_IP: return (int)(key->dst_ip % (unsigned int)options->num_ports);
+        default: return (int)(hash_connection(key) % (unsigned int)options->num_ports);
+    }
+}
+
+// -h file, one entry per line, '#' starts a comment:
+//   class <name> <parent name or -> <weight>
+//   match <src_ip[/len]|*> <src_port|*> <dst_ip[/len]|*> <dst_port|*> <class name>
+// Classes are declared before they are used. The first matching rule wins, connections that
+// match no rule hang directly off the root.
+int find_class_def(const Options* options, const char* name) {
+    for (size_t i = 0; i < options->class_defs.size(); i++) {
+        if (strcmp(options->class_defs[i].name, name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+int parse_match_ip(const char* token, unsigned int* match, unsigned int* mask) {
+    if (strcmp(token, "*") == 0) {
+        *match = *mask = 0;
+        return 1;
+    }
+    const char* slash = strchr(token, '/');
+    size_t len = slash ? (size_t)(slash - token) : strlen(token);
+    int bits = slash ? atoi(slash + 1) : 32;
+    if (bits < 0 || bits > 32) return 0;
+    parse_ipv4(token, token + len, match);
+    *mask = bits ? 0xffffffffU << (32 - bits) : 0;
+    *match &= *mask;
+    return 1;
+}
+
+int parse_match_port(const char* token, unsigned short* match, unsigned short* mask) {
+    if (strcmp(token, "*") == 0) {
+        *match = *mask = 0;
+    } else {
+        *match = (unsigned short)atoi(token);
+        *mask = 0xffff;
+    }
+    return 1;
+}
+
+void read_class_config(Options* options, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
         exit(1);
     }
+    char line[MAX_LINE_LEN];
+    char f[6][64];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = 0;
+        int n = sscanf(line, "%63s %63s %63s %63s %63s %63s", f[0], f[1], f[2], f[3], f[4], f[5]);
+        if (n <= 0) continue;
+        int ok = 0;
+        if (n == 4 && strcmp(f[0], "class") == 0 && find_class_def(options, f[1]) == -1) {
+            ClassDef def;
+            snprintf(def.name, sizeof(def.name), "%s", f[1]);
+            def.parent = (strcmp(f[2], "-") == 0) ? -1 : find_class_def(options, f[2]);
+            def.weight = atof(f[3]);
+            ok = (def.parent != -1 || strcmp(f[2], "-") == 0) && def.weight > 0;
+            if (ok) options->class_defs.push_back(def);
+        } else if (n == 6 && strcmp(f[0], "match") == 0) {
+            ClassRule rule;
+            rule.class_def = find_class_def(options, f[5]);
+            ok = rule.class_def != -1 &&
+                 parse_match_ip(f[1], &rule.match.src_ip, &rule.mask.src_ip) &&
+                 parse_match_port(f[2], &rule.match.src_port, &rule.mask.src_port) &&
+                 parse_match_ip(f[3], &rule.match.dst_ip, &rule.mask.dst_ip) &&
+                 parse_match_port(f[4], &rule.match.dst_port, &rule.mask.dst_port);
+            if (ok) options->class_rules.push_back(rule);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: bad class config line\n", path, line_no);
+            exit(1);
+        }
+    }
+    fclose(file);
+}
 
-    int id = num_connections++;
-    strcpy(connections[id].conn.src_ip, src_ip);
-    connections[id].conn.src_port = src_port;
-    strcpy(connections[id].conn.dst_ip, dst_ip);
-    connections[id].conn.dst_port = dst_port;
-    connections[id].weight = 1; // Default weight - THIS MUST BE 1
-    connections[id].virtual_finish_time = 0.0;
-    connections[id].appearance_order = appearance_order;
-    connections[id].active = 0;
+// scheduler class id for a new connection
+int classify_connection(const Options* options, const Connection* key) {
+    for (size_t i = 0; i < options->class_rules.size(); i++) {
+        const ClassRule* rule = &options->class_rules[i];
+        if ((key->src_ip & rule->mask.src_ip) == rule->match.src_ip &&
+            (key->dst_ip & rule->mask.dst_ip) == rule->match.dst_ip &&
+            (key->src_port & rule->mask.src_port) == rule->match.src_port &&
+            (key->dst_port & rule->mask.dst_port) == rule->match.dst_port) {
+            return rule->class_def + 1;
+        }
+    }
+    return ROOT_CLASS;
+}
 
-    return id;
+void parse_packet(Link* link, const char* line, size_t len, Packet* packet, int appearance_order) {
+    ParsedPacket parsed;
+    decode_line(line, len, &parsed);
+    parsed.appearance_order = appearance_order;
+    accept_packet(link, &parsed, packet);
+}
+
+// the part of parsing that needs no Link, producers (-P) and the dispatcher (-p) run it on their own
+// threads
+void decode_line(const char* line, size_t len, ParsedPacket* parsed) {
+    const char* p = line;
+    const char* end = line + len;
+    long long value;
+    parsed->line = line;
+    parsed->line_len = (int)len;
+    parsed->weight = NO_WEIGHT;
+
+    p = parse_uint(p, end, &parsed->arrival_time);
+    p = parse_ipv4(p, end, &parsed->key.src_ip);
+    p = parse_uint(p, end, &value);
+    parsed->key.src_port = (unsigned short)value;
+    p = parse_ipv4(p, end, &parsed->key.dst_ip);
+    p = parse_uint(p, end, &value);
+    parsed->key.dst_port = (unsigned short)value;
+    p = parse_uint(p, end, &value);
+    parsed->length = (int)value;
+    while (p < end && *p == ' ') p++;
+    if (p < end) {
+        parse_weight(p, end, &parsed->weight);
+    }
+}
+
+// decode_line() for a binary trace record, the record index is its appearance order
+void decode_record(const Input* input, long long index, ParsedPacket* parsed) {
+    const TraceRecord* record = &input->trace_records[index];
+    parsed->arrival_time = record->arrival_time;
+    parsed->weight = record->weight;
+    parsed->line = NULL;
+    parsed->key.src_ip = record->src_ip;
+    parsed->key.dst_ip = record->dst_ip;
+    parsed->key.src_port = record->src_port;
+    parsed->key.dst_port = record->dst_port;
+    parsed->line_len = 0;
+    parsed->length = record->length;
+    parsed->appearance_order = (int)index;
+}
+
+// a decoded packet joins the link: its text goes to the arena (binary traces keep the record
+// index) and its connection gets an id
+void accept_packet(Link* link, const ParsedPacket* parsed, Packet* packet) {
+    packet->arrival_time = parsed->arrival_time;
+    packet->weight = parsed->weight;
+    packet->length = parsed->length;
+    packet->appearance_order = parsed->appearance_order;
+    unsigned long long order = (unsigned long long)(unsigned int)parsed->appearance_order << 32;
+    if (parsed->line == NULL) {
+        packet->cookie = order | (unsigned int)parsed->appearance_order;
+    } else if (link->parse_into != NULL) {
+        packet->cookie = keep_line(link->parse_into, parsed->line, (size_t)parsed->line_len, parsed->appearance_order);
+    } else {
+        packet->cookie = order | arena_store_line(link, parsed->line, (size_t)parsed->line_len);
+    }
+    // arrivals are handled in input order, so resolving the connection here gives the same ids
+    int created;
+    packet->connection_id = find_or_create_connection(link, &parsed->key, &created);
+    packet->flow_class = (created && link->options->discipline == DISCIPLINE_HWFQ) ? classify_connection(link->options, &parsed->key) : -1;
+    if (link->reclaim) {
+        link->connection_use[packet->connection_id].in_flight++;
+        // a connection that was reclaimed comes back with the weight it had
+        double kept = created ? take_kept_weight(link, &parsed->key) : NO_WEIGHT;
+        if (kept != NO_WEIGHT && packet->weight == NO_WEIGHT) packet->weight = kept;
+    }
+}
+
+// producer side, waits while the queue is full
+void ingest_push(IngestQueue* queue, const ParsedPacket* parsed) {
+    unsigned int tail = queue->tail.load(std::memory_order_relaxed);
+    while (tail - queue->head_seen == INGEST_QUEUE_SIZE) {
+        queue->head_seen = queue->head.load(std::memory_order_acquire);
+        if (tail - queue->head_seen == INGEST_QUEUE_SIZE) std::this_thread::yield();
+    }
+    IngestItem* item = &queue->items[tail % INGEST_QUEUE_SIZE];
+    item->parsed = *parsed;
+    if (parsed->line != NULL) {
+        memcpy(item->text, parsed->line, (size_t)parsed->line_len);
+        item->parsed.line = item->text;
+    }
+    queue->tail.store(tail + 1, std::memory_order_release);
+}
+
+// consumer side: the queue's next packet, valid until ingest_pop(). NULL if there is none yet or,
+// once queue->finished is set, ever.
+const ParsedPacket* ingest_peek(IngestQueue* queue) {
+    unsigned int head = queue->head.load(std::memory_order_relaxed);
+    if (head == queue->tail_seen) {
+        int done = queue->done.load(std::memory_order_acquire); // before tail, so a done producer's last items are seen
+        queue->tail_seen = queue->tail.load(std::memory_order_acquire);
+        if (head == queue->tail_seen) {
+            queue->finished = done;
+            return NULL;
+        }
+    }
+    return &queue->items[head % INGEST_QUEUE_SIZE].parsed;
+}
+
+void ingest_pop(IngestQueue* queue) {
+    queue->head.store(queue->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// -P, -m, -p counterpart of read_next_packet: a k-way merge of the queues by arrival time, ties go
+// to the queue that comes first. It needs the next packet of every queue that is not finished, so
+// it waits for a producer that is behind. -P parts follow each other in the input, so a trace in
+// arrival order comes out in input order, as a single reader would take it.
+int read_ingested(Link* link) {
+    int best = -1;
+    const ParsedPacket* best_parsed = NULL;
+    for (int k = 0; k < link->num_ingest; k++) {
+        IngestQueue* queue = &link->ingest[k];
+        if (queue->finished) continue;
+        const ParsedPacket* parsed;
+        while ((parsed = ingest_peek(queue)) == NULL && !queue->finished) {
+            std::this_thread::yield();
+        }
+        if (parsed != NULL && (best == -1 || parsed->arrival_time < best_parsed->arrival_time)) {
+            best = k;
+            best_parsed = parsed;
+        }
+    }
+    if (best == -1) {
+        link->input_done = 1;
+        return 0;
+    }
+    ParsedPacket parsed = *best_parsed; // its line stays in the queue until ingest_pop()
+    if (parsed.appearance_order < 0) parsed.appearance_order = link->next_appearance_order;
+    Packet packet;
+    accept_packet(link, &parsed, &packet);
+    ingest_pop(&link->ingest[best]);
+    link->next_appearance_order = packet.appearance_order + 1;
+    link->pending_packets.push(packet);
+    return 1;
 }
 
-void parse_packet(const char* line, Packet* packet, int appearance_order) {
-    strcpy(packet->original_line, line);
-    packet->appearance_order = appearance_order;
-    packet->has_weight = 0;
-    packet -> is_on_bus = 0;
-
-    char* line_copy = my_strdup(line);
-    char* token = strtok(line_copy, " ");
-    int field = 0;
-
-    while (token != NULL) {
-        switch (field) {
-            case 0: packet->arrival_time = atoll(token); break;
-            case 1: strcpy(packet->src_ip, token); break;
-            case 2: packet->src_port = atoi(token); break;
-            case 3: strcpy(packet->dst_ip, token); break;
-            case 4: packet->dst_port = atoi(token); break;
-            case 5: packet->length = atoi(token); break;
-            case 6:
-                packet->weight = atof(token);
-                packet->has_weight = 1;
+// -P: where the producer's part of the shared input starts, the beginning of a line
+size_t chunk_start(const Input* input, int producer, int num_producers) {
+    if (producer == 0) return 0;
+    size_t at = (size_t)((double)input->shared_size * producer / num_producers);
+    const char* nl = (const char*)memchr(input->shared + at - 1, '\n', input->shared_size - (at - 1));
+    return (nl == NULL) ? input->shared_size : (size_t)(nl + 1 - input->shared);
+}
+
+// -P producer: decodes one contiguous part of the shared input, a range of records or of whole
+// lines. The link numbers lines as it merges them, records keep their index.
+void produce(const Input* input, std::vector<IngestQueue>* queues, int producer) {
+    IngestQueue* queue = &(*queues)[producer];
+    int num_producers = (int)queues->size();
+    ParsedPacket parsed;
+    if (input->trace_header != NULL) {
+        long long num_records = input->trace_header->num_records;
+        long long end = num_records * (producer + 1) / num_producers;
+        for (long long i = num_records * producer / num_producers; i < end; i++) {
+            decode_record(input, i, &parsed);
+            ingest_push(queue, &parsed);
+        }
+    } else {
+        // same line splitting as next_input_line() on a shared input, empty lines do not count
+        const char* start = input->shared + chunk_start(input, producer, num_producers);
+        const char* end = input->shared + chunk_start(input, producer + 1, num_producers);
+        for (const char* line = start; line < end;) {
+            const char* nl = (const char*)memchr(line, '\n', (size_t)(end - line));
+            if (nl == NULL) nl = end;
+            size_t len = (size_t)(nl - line);
+            if (len > MAX_LINE_LEN - 1) {
+                report_long_line((long long)(line - input->shared));
+                queue->bad_input = 1;
                 break;
+            }
+            if (len > 0) {
+                decode_line(line, len, &parsed);
+                parsed.appearance_order = -1;
+                ingest_push(queue, &parsed);
+            }
+            line = nl + 1;
+        }
+    }
+    queue->done.store(1, std::memory_order_release);
+}
+
+// -m producer: every packet of one source, read block by block like a single link reads stdin. A
+// binary trace's lines go with its records, so the link handles both kinds of source the same way.
+void produce_source(Link* reader, IngestQueue* queue) {
+    const Input* input = reader->input;
+    ParsedPacket parsed;
+    if (input->trace_header != NULL) {
+        for (long long i = 0; i < input->trace_header->num_records; i++) {
+            decode_record(input, i, &parsed);
+            parsed.line = input->trace_text + input->trace_records[i].text;
+            parsed.line_len = (int)strnlen(parsed.line, MAX_LINE_LEN - 1);
+            parsed.appearance_order = -1;
+            ingest_push(queue, &parsed);
+        }
+    } else {
+        const char* line;
+        size_t len;
+        while (next_input_line(reader, &line, &len)) {
+            if (len == 0) continue;
+            decode_line(line, len, &parsed);
+            parsed.appearance_order = -1;
+            ingest_push(queue, &parsed);
+        }
+    }
+    queue->done.store(1, std::memory_order_release);
+}
+
+// -p: decodes every line (or record) of the input once and queues it for the link it is routed to.
+// Appearance orders count the whole input, as the links' own parsing used to.
+void dispatch(Link* reader, std::vector<IngestQueue>* queues) {
+    const Options* options = reader->options;
+    const Input* input = reader->input;
+    ParsedPacket parsed;
+    PROFILE_BEGIN();
+    if (input->trace_header != NULL) {
+        for (long long i = 0; i < input->trace_header->num_records; i++) {
+            decode_record(input, i, &parsed);
+            ingest_push(&(*queues)[route_port(options, &parsed.key)], &parsed);
+        }
+    } else {
+        const char* line;
+        size_t len;
+        while (next_input_line(reader, &line, &len)) {
+            if (len == 0) continue;
+            decode_line(line, len, &parsed);
+            parsed.appearance_order = reader->next_appearance_order++;
+            ingest_push(&(*queues)[route_port(options, &parsed.key)], &parsed);
         }
-        field++;
-        token = strtok(NULL, " ");
     }
+    for (size_t k = 0; k < queues->size(); k++) (*queues)[k].done.store(1, std::memory_order_release);
+    PROFILE_END(profile_parse_ns);
+}
 
-    free(line_copy);
+// binary trace counterpart of parse_packet, the record index doubles as line_ref and appearance_order
+void load_record(Link* link, unsigned int index, Packet* packet) {
+    const TraceRecord* record = &link->input->trace_records[index];
+    Connection key;
+    key.src_ip = record->src_ip;
+    key.dst_ip = record->dst_ip;
+    key.src_port = record->src_port;
+    key.dst_port = record->dst_port;
+    link->next_appearance_order = (int)index + 1;
+    packet->arrival_time = record->arrival_time;
+    packet->weight = record->weight;
+    packet->cookie = ((unsigned long long)index << 32) | index;
+    packet->length = record->length;
+    packet->appearance_order = (int)index;
+    packet->flow_class = -1;
+    // a single link sees every record, so the converter's ids are the ones it would assign. The
+    // table is still needed to classify (-h) and to name connections in the statistics (-s).
+    const Options* options = link->options;
+    int keep_table = options->discipline == DISCIPLINE_HWFQ || options->stats_format != STATS_OFF;
+    if (!keep_table) {
+        packet->connection_id = record->flow;
+        return;
+    }
+    int created;
+    packet->connection_id = find_or_create_connection(link, &key, &created);
+    if (created && options->discipline == DISCIPLINE_HWFQ) {
+        packet->flow_class = classify_connection(options, &key);
+    }
+}
 
+// -c: text trace on stdin to a binary trace on stdout. The records are written as they are parsed
+// and the text goes to a temp file that is appended at the end, then the header is filled in, so
+// stdout has to be a file.
+int convert_trace(Link* link) {
+    link->reclaim = 0; // the records keep the ids of first appearance
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, 8);
+    header.version = TRACE_VERSION;
+    header.record_size = (int)sizeof(TraceRecord);
+    FILE* text = tmpfile();
+    if (text == NULL || fwrite(&header, sizeof(header), 1, stdout) != 1) {
+        perror("convert");
+        return 1;
+    }
 
+    const char* line;
+    size_t len;
+    unsigned long long text_size = 0;
+    while (next_input_line(link, &line, &len)) {
+        if (len == 0) continue;
+        Packet packet;
+        parse_packet(link, line, len, &packet, link->next_appearance_order++);
+        const Connection* key = &link->connections[packet.connection_id];
+        TraceRecord record;
+        memset(&record, 0, sizeof(record));
+        record.arrival_time = packet.arrival_time;
+        record.weight = packet.weight;
+        record.text = text_size;
+        record.src_ip = key->src_ip;
+        record.dst_ip = key->dst_ip;
+        record.src_port = key->src_port;
+        record.dst_port = key->dst_port;
+        record.length = packet.length;
+        record.flow = packet.connection_id;
+        fwrite(&record, sizeof(record), 1, stdout);
+        fwrite(line, 1, len, text);
+        fputc(0, text);
+        text_size += len + 1;
+        arena_release_line(link, (unsigned int)packet.cookie);
+        header.num_records++;
+    }
+    if (link->bad_input) {
+        fclose(text);
+        return 1;
+    }
 
+    header.num_flows = link->num_connections;
+    header.text_offset = (long long)(sizeof(TraceHeader) + header.num_records * sizeof(TraceRecord));
+    rewind(text);
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), text)) > 0) fwrite(buf, 1, n, stdout);
+    fclose(text);
+    if (fseek(stdout, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, stdout) != 1 || fflush(stdout) != 0) {
+        perror("convert (stdout has to be a file)");
+        return 1;
+    }
+    return 0;
 }
 
 
 
-void schedule_next_packet() {
-    if (ready_queue.empty()) return;
+// writes digits of value to dst, returns the end
+char* format_ll(char* dst, long long value) {
+    char tmp[24];
+    int n = 0;
+    unsigned long long v = (value < 0) ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    if (value < 0) *dst++ = '-';
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (n) *dst++ = tmp[--n];
+    return dst;
+}
 
+void output_packet(Link* link, const WfqDeparture* departure) {
+    PROFILE_BEGIN();
+    PROFILE_COUNT_PACKET();
+    link->departures++;
+    // -T keeps text lines in LineBlocks, the cookie points at the line
+    const PipelineLine* kept = (link->pipeline != NULL && link->input->trace_header == NULL)
+                                   ? (const PipelineLine*)(uintptr_t)departure->cookie : NULL;
+    if (link->output_used + MAX_LINE_LEN + 32 > OUTPUT_BUFFER_SIZE) {
+        output_flush(link);
+    }
+    if (link->options->binary_output) {
+        OutputRecord record;
+        record.start_time = departure->start_time;
+        record.appearance_order = kept ? kept->appearance_order : (int)(departure->cookie >> 32);
+        record.connection_id = departure->flow;
+        record.length = departure->length;
+        record.reserved = 0;
+        memcpy(link->output_buffer + link->output_used, &record, sizeof(record));
+        link->output_used += sizeof(record);
+    } else {
+        char* out = format_ll(link->output_buffer + link->output_used, departure->start_time);
+        *out++ = ':';
+        *out++ = ' ';
+        const char* line = kept ? kept->text : packet_line(link, (unsigned int)departure->cookie);
+        size_t len = strlen(line);
+        memcpy(out, line, len);
+        out += len;
+        *out++ = '\n';
+        link->output_used = (size_t)(out - link->output_buffer);
+    }
+    if (kept != NULL) {
+        release_kept_line(kept);
+    } else if (link->input->trace_header == NULL) {
+        arena_release_line(link, (unsigned int)departure->cookie);
+    }
+    PROFILE_END(profile_output_ns);
+}
 
-        Packet packet_to_send = ready_queue.top();
-        packet_to_send.is_on_bus = 1;
-    //remove_packet_from_queue(&ready_queue, best_idx);
-        is_packet_on_bus = 1;
-        //packet_on_bus_idx = best_idx;
-        ready_queue.pop();
-    if ((current_time <= debug_arrival_time_1 && current_time >= debug_arrival_time_2) && Debug == 1) {
-        printf("new packet on bus at time %lf, %s\n", current_time, packet_to_send.original_line);
+void output_flush(Link* link) {
+    if (link->output_used == 0) return;
+#ifndef _WIN32
+    size_t done = 0;
+    while (done < link->output_used) {
+        ssize_t n = write(fileno(link->output_file), link->output_buffer + done, link->output_used - done);
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        done += (size_t)n;
     }
+#else
+    fwrite(link->output_buffer, 1, link->output_used, link->output_file);
+#endif
+    link->output_written += (long long)link->output_used;
+    link->output_used = 0;
+}
 
+// log-linear bucket of a delay, O(1) and at most 1/16 wide relative to its values
+int delay_bucket(long long delay) {
+    unsigned long long d = (delay > 0) ? (unsigned long long)delay : 0;
+    if (d < (1ULL << DELAY_SUB_BUCKET_BITS)) return (int)d;
+#if defined(__GNUC__)
+    int exponent = 63 - __builtin_clzll(d);
+#else
+    int exponent = 0;
+    while ((d >> exponent) > 1) exponent++;
+#endif
+    int shift = exponent - DELAY_SUB_BUCKET_BITS;
+    return ((shift + 1) << DELAY_SUB_BUCKET_BITS) + (int)((d >> shift) & ((1ULL << DELAY_SUB_BUCKET_BITS) - 1));
+}
 
-    // Determine actual start time for this packet
-    // real_time currently holds when the server *became free* from the *previous* transmission (or 0 if idle)
-    long long actual_start_time = (next_departure_time > packet_to_send.arrival_time) ? next_departure_time : packet_to_send.arrival_time;
+// largest delay that falls into bucket
+long long delay_bucket_max(int bucket) {
+    if (bucket < (1 << DELAY_SUB_BUCKET_BITS)) return bucket;
+    int shift = (bucket >> DELAY_SUB_BUCKET_BITS) - 1;
+    long long sub = bucket & ((1 << DELAY_SUB_BUCKET_BITS) - 1);
+    long long low = ((1LL << DELAY_SUB_BUCKET_BITS) + sub) << shift;
+    return low + ((1LL << shift) - 1);
+}
 
-    // Original output format restored
-    printf("%lld: %s\n", actual_start_time, packet_to_send.original_line);
+// upper end of the bucket holding the q-quantile
+long long delay_percentile(const long long* histogram, long long count, double q) {
+    long long rank = (long long)(q * (double)count);
+    if (rank >= count) rank = count - 1;
+    long long seen = 0;
+    for (int b = 0; b < DELAY_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen > rank) return delay_bucket_max(b);
+    }
+    return 0;
+}
 
+// grown on demand by the scheduling thread, so it never shares the array with the parsing one
+FlowStats* flow_stats_at(Link* link, int id) {
+    if (id >= link->flow_stats_count) {
+        if (id >= link->flow_stats_capacity) {
+            link->flow_stats_capacity = std::max(id + 1, link->flow_stats_capacity ? link->flow_stats_capacity * 2 : INITIAL_CONNECTION_CAPACITY);
+            link->flow_stats = (FlowStats*)realloc(link->flow_stats, link->flow_stats_capacity * sizeof(FlowStats));
+        }
+        for (; link->flow_stats_count <= id; link->flow_stats_count++) {
+            memset(&link->flow_stats[link->flow_stats_count], 0, sizeof(FlowStats));
+            link->flow_stats[link->flow_stats_count].weight = 1;
+        }
+    }
+    return &link->flow_stats[id];
+}
 
+void record_stats(Link* link, const WfqDeparture* departure) {
+    FlowStats* stats = flow_stats_at(link, departure->flow);
+    long long delay = departure->start_time - departure->arrival_time;
+    stats->packets++;
+    stats->bytes += departure->length;
+    stats->delay_sum += delay;
+    if (delay > stats->delay_max) stats->delay_max = delay;
+    link->delay_histogram[delay_bucket(delay)]++;
+    if (departure->arrival_time < link->first_arrival) link->first_arrival = departure->arrival_time;
+    if (departure->start_time + departure->length > link->last_finish) link->last_finish = departure->start_time + departure->length;
+}
 
-    // Update virtual time
-    // Calculate weight sum of connections that were in ready_queue *before* this packet was removed
-    // double current_weight_sum = 0;
+// dotted quad of a host byte order address
+void format_ip(char* dst, size_t size, unsigned int ip) {
+    snprintf(dst, size, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+}
 
-    // Update server's next free time
-    next_departure_time = actual_start_time + packet_to_send.length;
+// one connection of the statistics, a CSV row or a JSON object
+void write_flow_stats(FILE* file, const Link* link, int id, int json) {
+    const FlowStats* stats = &link->flow_stats[id];
+    const Connection* c = &link->connections[id];
+    char src[MAX_IP_LEN], dst[MAX_IP_LEN];
+    format_ip(src, sizeof(src), c->src_ip);
+    format_ip(dst, sizeof(dst), c->dst_ip);
+    double mean = (double)stats->delay_sum / (double)stats->packets;
+    if (json) {
+        fprintf(file, "{\"flow\": %d, \"src_ip\": \"%s\", \"src_port\": %u, \"dst_ip\": \"%s\", \"dst_port\": %u, \"weight\": %g, "
+                      "\"packets\": %lld, \"bytes\": %lld, \"delay_mean\": %.3f, \"delay_max\": %lld}",
+                id, src, c->src_port, dst, c->dst_port, stats->weight, stats->packets, stats->bytes, mean, stats->delay_max);
+    } else {
+        fprintf(file, "%d,%d,%s,%u,%s,%u,%g,%lld,%lld,%.3f,%lld\n", link->port, id, src, c->src_port, dst, c->dst_port,
+                stats->weight, stats->packets, stats->bytes, mean, stats->delay_max);
+    }
 }
 
+// One summary per link plus one row per connection that sent anything. Utilisation is bytes sent
+// over the time from the first arrival to the end of the last transmission (the link sends 1 byte
+// per time unit), the fairness index is Jain's over bytes / weight. The CSV form puts the summaries
+// on '#' lines ahead of a single table.
+int write_stats(Link* const* links, int num_links, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    int json = links[0]->options->stats_format == STATS_JSON;
+    if (json) fprintf(file, "{\"links\": [\n");
+    for (int l = 0; l < num_links; l++) {
+        const Link* link = links[l];
+        long long packets = 0, bytes = 0, delay_sum = 0, delay_max = 0;
+        double share_sum = 0, share_sq_sum = 0;
+        int active = 0;
+        for (int i = 0; i < link->flow_stats_count; i++) {
+            const FlowStats* stats = &link->flow_stats[i];
+            if (stats->packets == 0) continue;
+            packets += stats->packets;
+            bytes += stats->bytes;
+            delay_sum += stats->delay_sum;
+            if (stats->delay_max > delay_max) delay_max = stats->delay_max;
+            double share = (double)stats->bytes / stats->weight;
+            share_sum += share;
+            share_sq_sum += share * share;
+            active++;
+        }
+        long long span = link->last_finish - link->first_arrival;
+        double utilisation = (span > 0) ? (double)bytes / (double)span : 0;
+        double fairness = (share_sq_sum > 0) ? share_sum * share_sum / (active * share_sq_sum) : 0;
+        double delay_mean = packets ? (double)delay_sum / (double)packets : 0;
+        long long p50 = packets ? std::min(delay_percentile(link->delay_histogram, packets, 0.5), delay_max) : 0;
+        long long p99 = packets ? std::min(delay_percentile(link->delay_histogram, packets, 0.99), delay_max) : 0;
+        long long p999 = packets ? std::min(delay_percentile(link->delay_histogram, packets, 0.999), delay_max) : 0;
+
+        if (!json) {
+            fprintf(file, "# port=%d packets=%lld bytes=%lld utilisation=%.6f fairness=%.6f delay_mean=%.3f "
+                          "delay_p50=%lld delay_p99=%lld delay_p999=%lld delay_max=%lld\n",
+                    link->port, packets, bytes, utilisation, fairness, delay_mean, p50, p99, p999, delay_max);
+            continue;
+        }
+        fprintf(file, "  {\"port\": %d, \"packets\": %lld, \"bytes\": %lld, \"utilisation\": %.6f, \"fairness\": %.6f, "
+                      "\"delay_mean\": %.3f, \"delay_p50\": %lld, \"delay_p99\": %lld, \"delay_p999\": %lld, \"delay_max\": %lld,\n"
+                      "   \"flows\": [",
+                link->port, packets, bytes, utilisation, fairness, delay_mean, p50, p99, p999, delay_max);
+        const char* separator = "\n    ";
+        for (int i = 0; i < link->flow_stats_count; i++) {
+            if (link->flow_stats[i].packets == 0) continue;
+            fputs(separator, file);
+            write_flow_stats(file, link, i, 1);
+            separator = ",\n    ";
+        }
+        fprintf(file, "]}%s\n", (l == num_links - 1) ? "" : ",");
+    }
+    if (json) {
+        fprintf(file, "]}\n");
+    } else {
+        fprintf(file, "port,flow,src_ip,src_port,dst_ip,dst_port,weight,packets,bytes,delay_mean,delay_max\n");
+        for (int l = 0; l < num_links; l++) {
+            for (int i = 0; i < links[l]->flow_stats_count; i++) {
+                if (links[l]->flow_stats[i].packets != 0) write_flow_stats(file, links[l], i, 0);
+            }
+        }
+    }
+    if (fclose(file) != 0) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
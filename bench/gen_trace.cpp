@@ -0,0 +1,208 @@
+// Synthetic trace generator for the benchmarks.
+// Writes "arrival src_ip src_port dst_ip dst_port length [weight]" lines, sorted by arrival, to stdout.
+//
+//   gen_trace [-n packets] [-f flows] [-w none|uniform|bimodal|zipf] [-b burst] [-s imix|fixed:N|uniform:LO:HI]
+//             [-c weight_change_prob] [-l load] [-z flow_skew] [-r seed]
+//
+//   -n  total packets (up to 10^8 and beyond, output is streamed)
+//   -f  number of distinct 4-tuples
+//   -w  how flow weights are drawn, printed on a flow's first packet ("none" never prints one)
+//   -b  mean burst length, a burst is back to back packets of one flow
+//   -s  packet size mix
+//   -c  per packet probability that the flow switches to a new weight
+//   -l  offered load relative to the link (1 byte per time unit), > 1 builds a backlog
+//   -z  zipf exponent for picking flows, 0 = uniform
+//   -r  random seed
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <vector>
+
+#define OUT_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    unsigned int src_ip;
+    unsigned int dst_ip;
+    int src_port;
+    int dst_port;
+    double weight;
+    int announced; // weight already printed once
+} Flow;
+
+unsigned long long rng_state = 88172645463325252ULL;
+
+unsigned long long rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+double rng_uniform() {
+    return (double)(rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+long long packets = 100000;
+int num_flows = 100;
+const char* weight_mode = "uniform";
+double burst = 1.0;
+const char* size_mode = "imix";
+double weight_change_prob = 0.0;
+double load = 0.9;
+double flow_skew = 1.0;
+std::vector<Flow> flows;
+std::vector<double> flow_cdf;
+char out[OUT_BUFFER_SIZE];
+size_t out_used = 0;
+
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-n packets] [-f flows] [-w none|uniform|bimodal|zipf] [-b burst]\n"
+                    "          [-s imix|fixed:N|uniform:LO:HI] [-c weight_change_prob] [-l load] [-z flow_skew] [-r seed]\n", prog);
+    exit(1);
+}
+
+// weights are multiples of 1/4 so the text form is exact
+double draw_weight() {
+    if (strcmp(weight_mode, "bimodal") == 0) {
+        return (rng_uniform() < 0.9) ? 1.0 : 10.0;
+    }
+    if (strcmp(weight_mode, "zipf") == 0) {
+        return floor(4.0 / pow(1.0 - rng_uniform(), 1.0 / 1.2)) / 4.0;
+    }
+    return (double)(1 + (int)(rng_uniform() * 32)) / 4.0; // uniform in [0.25, 8]
+}
+
+int draw_size() {
+    if (strncmp(size_mode, "fixed:", 6) == 0) {
+        return atoi(size_mode + 6);
+    }
+    if (strncmp(size_mode, "uniform:", 8) == 0) {
+        int lo = 1, hi = 1500;
+        sscanf(size_mode + 8, "%d:%d", &lo, &hi);
+        return lo + (int)(rng_uniform() * (hi - lo + 1));
+    }
+    double u = rng_uniform(); // imix 7:4:1
+    if (u < 7.0 / 12) return 64;
+    if (u < 11.0 / 12) return 576;
+    return 1500;
+}
+
+int draw_flow() {
+    double u = rng_uniform();
+    size_t lo = 0, hi = flow_cdf.size() - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (flow_cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    return (int)lo;
+}
+
+void flush_out() {
+    fwrite(out, 1, out_used, stdout);
+    out_used = 0;
+}
+
+char* put_uint(char* p, unsigned long long v) {
+    char tmp[24];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+char* put_ip(char* p, unsigned int ip) {
+    p = put_uint(p, ip >> 24);
+    *p++ = '.';
+    p = put_uint(p, (ip >> 16) & 0xff);
+    *p++ = '.';
+    p = put_uint(p, (ip >> 8) & 0xff);
+    *p++ = '.';
+    return put_uint(p, ip & 0xff);
+}
+
+void emit(long long arrival, Flow* flow, int length, int with_weight) {
+    if (out_used + 128 > OUT_BUFFER_SIZE) flush_out();
+    char* p = out + out_used;
+    p = put_uint(p, (unsigned long long)arrival);
+    *p++ = ' ';
+    p = put_ip(p, flow->src_ip);
+    *p++ = ' ';
+    p = put_uint(p, (unsigned long long)flow->src_port);
+    *p++ = ' ';
+    p = put_ip(p, flow->dst_ip);
+    *p++ = ' ';
+    p = put_uint(p, (unsigned long long)flow->dst_port);
+    *p++ = ' ';
+    p = put_uint(p, (unsigned long long)length);
+    if (with_weight) {
+        p += sprintf(p, " %g", flow->weight);
+    }
+    *p++ = '\n';
+    out_used = (size_t)(p - out);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0 || i + 1 >= argc) usage(argv[0]);
+        const char* value = argv[++i];
+        switch (argv[i - 1][1]) {
+            case 'n': packets = atoll(value); break;
+            case 'f': num_flows = atoi(value); break;
+            case 'w': weight_mode = value; break;
+            case 'b': burst = atof(value); break;
+            case 's': size_mode = value; break;
+            case 'c': weight_change_prob = atof(value); break;
+            case 'l': load = atof(value); break;
+            case 'z': flow_skew = atof(value); break;
+            case 'r': rng_state ^= (unsigned long long)atoll(value) * 0x9E3779B97F4A7C15ULL; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (num_flows < 1 || burst < 1.0 || load <= 0) usage(argv[0]);
+
+    double total = 0;
+    flows.resize(num_flows);
+    flow_cdf.resize(num_flows);
+    for (int i = 0; i < num_flows; i++) {
+        flows[i].src_ip = (unsigned int)rng_next();
+        flows[i].dst_ip = (unsigned int)rng_next();
+        flows[i].src_port = (int)(rng_next() % 65536);
+        flows[i].dst_port = (int)(rng_next() % 65536);
+        flows[i].weight = draw_weight();
+        flows[i].announced = 0;
+        total += 1.0 / pow((double)(i + 1), flow_skew);
+        flow_cdf[i] = total;
+    }
+    for (int i = 0; i < num_flows; i++) flow_cdf[i] /= total;
+
+    // mean gap between bursts so that bytes offered per time unit comes out at `load`
+    double mean_size = 0;
+    for (int i = 0; i < 1000; i++) mean_size += draw_size();
+    mean_size /= 1000;
+    double mean_gap = mean_size * burst / load;
+    int with_weights = strcmp(weight_mode, "none") != 0;
+
+    long long arrival = 0;
+    long long emitted = 0;
+    while (emitted < packets) {
+        arrival += (long long)(-log(1.0 - rng_uniform()) * mean_gap);
+        Flow* flow = &flows[draw_flow()];
+        long long burst_len = 1 + (long long)(-log(1.0 - rng_uniform()) * (burst - 1.0));
+        for (long long k = 0; k < burst_len && emitted < packets; k++, emitted++) {
+            int with_weight = 0;
+            if (with_weights && (!flow->announced || rng_uniform() < weight_change_prob)) {
+                if (flow->announced) flow->weight = draw_weight();
+                flow->announced = 1;
+                with_weight = 1;
+            }
+            emit(arrival, flow, draw_size(), with_weight);
+        }
+    }
+    flush_out();
+    return 0;
+}
@@ -0,0 +1,192 @@
+// Benchmark harness: generates traces with gen_trace and replays each one through every engine.
+// Reports packets/sec, ns/packet split into parse / schedule / output (from the wfq-profile line the
+// -DWFQ_PROFILE=1 builds print, see wfq_profile.h) and peak RSS.
+//
+//   wfq_bench -g path/to/gen_trace -e name=path[:max_packets] [-e ...] [-n packets] [-s scenario] [-k dir]
+//
+//   -e  engine to run, max_packets caps the trace size for it
+//   -n  packets per scenario, default 1000000
+//   -s  run only this scenario, can be repeated
+//   -k  keep the generated traces in dir instead of a temp dir that is removed afterwards
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    const char* name;
+    const char* gen_args;
+} Scenario;
+
+typedef struct {
+    std::string name;
+    std::string path;
+    long long max_packets;
+} Engine;
+
+typedef struct {
+    int ok;
+    double wall_s;
+    long long packets;
+    long long total_ns, parse_ns, schedule_ns, output_ns;
+    long maxrss_kb;
+} RunResult;
+
+const Scenario scenarios[] = {
+    {"few-flows", "-f 10 -w uniform -l 0.9"},
+    {"many-flows", "-f 200000 -w uniform -z 0.6 -l 0.95"},
+    {"bursty-overload", "-f 500 -w bimodal -b 16 -l 1.2 -c 0.01"},
+    {"elephants", "-f 2000 -w zipf -z 1.6 -l 1.05 -s uniform:40:1500"},
+    {"tiny-packets", "-f 100 -w none -s fixed:64 -l 0.99"},
+};
+
+std::vector<Engine> engines;
+std::vector<std::string> only_scenarios;
+const char* gen_path = NULL;
+long long packets = 1000000;
+std::string trace_dir;
+int keep_traces = 0;
+
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s -g gen_trace -e name=path[:max_packets] [-e ...] [-n packets] [-s scenario] [-k dir]\n", prog);
+    exit(1);
+}
+
+double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int generate(const Scenario* scenario, long long n, const std::string& path) {
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "'%s' -n %lld %s -r 1 > '%s'", gen_path, n, scenario->gen_args, path.c_str());
+    return system(cmd) == 0;
+}
+
+RunResult run_engine(const Engine* engine, const std::string& trace) {
+    RunResult result;
+    memset(&result, 0, sizeof(result));
+    int err_pipe[2];
+    if (pipe(err_pipe) != 0) return result;
+
+    double start = now_s();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int in = open(trace.c_str(), O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0) _exit(127);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        close(err_pipe[0]);
+        execl(engine->path.c_str(), engine->path.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    close(err_pipe[1]);
+
+    std::string err;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(err_pipe[0], buf, sizeof(buf))) > 0) err.append(buf, (size_t)n);
+    close(err_pipe[0]);
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.wall_s = now_s() - start;
+    result.maxrss_kb = usage.ru_maxrss;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    size_t pos = err.find("wfq-profile ");
+    if (pos != std::string::npos) {
+        long rss;
+        sscanf(err.c_str() + pos, "wfq-profile packets=%lld total_ns=%lld parse_ns=%lld schedule_ns=%lld output_ns=%lld maxrss_kb=%ld",
+               &result.packets, &result.total_ns, &result.parse_ns, &result.schedule_ns, &result.output_ns, &rss);
+    }
+    return result;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0 || i + 1 >= argc) usage(argv[0]);
+        const char* value = argv[++i];
+        switch (argv[i - 1][1]) {
+            case 'g': gen_path = value; break;
+            case 'n': packets = atoll(value); break;
+            case 's': only_scenarios.push_back(value); break;
+            case 'k': trace_dir = value; keep_traces = 1; break;
+            case 'e': {
+                Engine engine;
+                const char* eq = strchr(value, '=');
+                if (eq == NULL) usage(argv[0]);
+                engine.name.assign(value, (size_t)(eq - value));
+                engine.path = eq + 1;
+                engine.max_packets = -1;
+                size_t colon = engine.path.rfind(':');
+                if (colon != std::string::npos) {
+                    engine.max_packets = atoll(engine.path.c_str() + colon + 1);
+                    engine.path.resize(colon);
+                }
+                engines.push_back(engine);
+                break;
+            }
+            default: usage(argv[0]);
+        }
+    }
+    if (gen_path == NULL || engines.empty()) usage(argv[0]);
+
+    if (!keep_traces) {
+        char tmpl[] = "/tmp/wfq_bench.XXXXXX";
+        if (mkdtemp(tmpl) == NULL) {
+            perror("mkdtemp");
+            return 1;
+        }
+        trace_dir = tmpl;
+    }
+
+    printf("%-16s %-12s %10s %9s %10s %9s %9s %9s %9s %9s\n", "scenario", "engine", "packets", "wall_s",
+           "Mpkt/s", "ns/pkt", "parse", "schedule", "output", "rss_MB");
+    int failures = 0;
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+        const Scenario* scenario = &scenarios[s];
+        if (!only_scenarios.empty()) {
+            int wanted = 0;
+            for (size_t k = 0; k < only_scenarios.size(); k++) wanted |= (only_scenarios[k] == scenario->name);
+            if (!wanted) continue;
+        }
+        for (size_t e = 0; e < engines.size(); e++) {
+            long long n = packets;
+            if (engines[e].max_packets > 0 && engines[e].max_packets < n) n = engines[e].max_packets;
+            std::string trace = trace_dir + "/" + scenario->name + "." + std::to_string(n) + ".txt";
+            if (access(trace.c_str(), R_OK) != 0 && !generate(scenario, n, trace)) {
+                fprintf(stderr, "could not generate %s\n", trace.c_str());
+                return 1;
+            }
+
+            RunResult r = run_engine(&engines[e], trace);
+            if (!r.ok) failures++;
+            double per = (r.packets > 0) ? 1.0 / (double)r.packets : 0;
+            printf("%-16s %-12s %10lld %9.3f %10.3f %9.1f %9.1f %9.1f %9.1f %9.1f%s\n", scenario->name,
+                   engines[e].name.c_str(), r.packets, r.wall_s, r.packets / r.wall_s / 1e6, r.total_ns * per,
+                   r.parse_ns * per, r.schedule_ns * per, r.output_ns * per, r.maxrss_kb / 1024.0,
+                   r.ok ? "" : "  FAILED");
+            fflush(stdout);
+        }
+    }
+
+    if (!keep_traces) {
+        std::string cmd = "rm -rf '" + trace_dir + "'";
+        if (system(cmd.c_str()) != 0) fprintf(stderr, "could not remove %s\n", trace_dir.c_str());
+    }
+    return failures ? 1 : 0;
+}
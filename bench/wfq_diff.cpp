@@ -0,0 +1,301 @@
+// Differential harness: generates traces with gen_trace, replays each one through every engine and
+// diffs every schedule against the first engine's. Reports the first divergence with the lines
+// around it, and the wall time and peak RSS of every run.
+//
+//   wfq_diff -g path/to/gen_trace -e name=path[ args] [-e ...] [-i name] [-S name] [-n packets] [-r runs]
+//            [-s scenario] [-c context] [-k dir]
+//
+//   -e  engine, the first one is the reference. Arguments after the path are passed to it, so one
+//       binary can be diffed against itself with a different option (-e pipelined="new_better_wfq -T")
+//   -i  the named engine is expected to differ (another discipline or tie-breaking), its
+//       divergences are reported but do not fail the run, can be repeated
+//   -S  the named engine is also run through a snapshot round trip, as name+resume: with
+//       -S file -i 0.000001 it snapshots every few thousand time steps, then -R file carries on from
+//       the last snapshot and appends to the schedule, which has to come out the same. Can be repeated
+//   -n  packets per trace, default 200000
+//   -r  seeds per scenario, default 3
+//   -s  run only this scenario, can be repeated
+//   -c  lines of context around a divergence, default 3
+//   -k  keep traces and schedules in dir instead of a temp dir that is removed afterwards
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LINE_LEN 512
+#define RUN_TIME_LIMIT 300 // seconds, an engine that hangs fails its run instead of the whole check
+
+typedef struct {
+    const char* name;
+    const char* gen_args;
+} Scenario;
+
+typedef struct {
+    std::string name;
+    std::vector<std::string> argv; // path and arguments
+    int informational;
+    int resumed; // -S
+} Engine;
+
+typedef struct {
+    int ok;
+    double wall_s;
+    long maxrss_kb;
+} RunResult;
+
+// small and tie-heavy on purpose, equal finish times are where the engines can disagree
+const Scenario scenarios[] = {
+    {"few-flows", "-f 10 -w uniform -l 0.9"},
+    {"equal-weights", "-f 50 -w none -s fixed:100 -l 1.1"},
+    {"bursty-overload", "-f 500 -w bimodal -b 16 -l 1.2 -c 0.01"},
+    {"elephants", "-f 2000 -w zipf -z 1.6 -l 1.05 -s uniform:40:1500"},
+    {"many-flows", "-f 5000 -w uniform -l 1.05"}, // more connections than the first table holds
+    {"weight-changes", "-f 200 -w uniform -c 0.05 -l 1.0"},
+};
+
+std::vector<Engine> engines;
+std::vector<std::string> only_scenarios;
+std::vector<std::string> informational;
+std::vector<std::string> resumed;
+const char* gen_path = NULL;
+long long packets = 200000;
+int runs = 3;
+int context = 3;
+std::string work_dir;
+int keep_files = 0;
+
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s -g gen_trace -e name=path[ args] [-e ...] [-i name] [-S name] [-n packets] [-r runs]\n"
+                    "          [-s scenario] [-c context] [-k dir]\n", prog);
+    exit(1);
+}
+
+double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int generate(const Scenario* scenario, int seed, const std::string& path) {
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "'%s' -n %lld %s -r %d > '%s'", gen_path, packets, scenario->gen_args, seed, path.c_str());
+    return system(cmd) == 0;
+}
+
+// append: the schedule is added to, as a resumed run's output is (snapshot restores truncate it first)
+RunResult run_engine(const Engine* engine, const std::string& trace, const std::string& schedule, int append) {
+    RunResult result;
+    memset(&result, 0, sizeof(result));
+    std::vector<char*> args;
+    for (size_t i = 0; i < engine->argv.size(); i++) args.push_back((char*)engine->argv[i].c_str());
+    args.push_back(NULL);
+
+    double start = now_s();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int in = open(trace.c_str(), O_RDONLY);
+        int out = open(schedule.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        if (in < 0 || out < 0) _exit(127);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        alarm(RUN_TIME_LIMIT);
+        execv(args[0], &args[0]);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.wall_s = now_s() - start;
+    result.maxrss_kb = usage.ru_maxrss;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return result;
+}
+
+// -S: the engine run once taking snapshots and once more from the last of them, the wall time and
+// RSS are the two runs' sum and maximum
+RunResult run_resumed(const Engine* engine, const std::string& trace, const std::string& schedule,
+                      const std::string& snapshot) {
+    Engine taking = *engine;
+    taking.argv.push_back("-S");
+    taking.argv.push_back(snapshot);
+    taking.argv.push_back("-i");
+    taking.argv.push_back("0.000001");
+    RunResult first = run_engine(&taking, trace, schedule, 0);
+    if (!first.ok || access(snapshot.c_str(), R_OK) != 0) {
+        first.ok = 0;
+        return first;
+    }
+    Engine restoring = *engine;
+    restoring.argv.push_back("-R");
+    restoring.argv.push_back(snapshot);
+    RunResult second = run_engine(&restoring, trace, schedule, 1);
+    second.wall_s += first.wall_s;
+    if (first.maxrss_kb > second.maxrss_kb) second.maxrss_kb = first.maxrss_kb;
+    return second;
+}
+
+// strips the newline, returns 0 at end of file
+int read_line(FILE* file, char* line) {
+    if (fgets(line, MAX_LINE_LEN, file) == NULL) return 0;
+    line[strcspn(line, "\n")] = 0;
+    return 1;
+}
+
+long long count_lines(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == NULL) return 0;
+    char line[MAX_LINE_LEN];
+    long long lines = 0;
+    while (read_line(file, line)) lines++;
+    fclose(file);
+    return lines;
+}
+
+// Compares a schedule with the reference's line by line. Returns the number of the first line that
+// differs (from 1) after printing it with its context, 0 if they are the same.
+long long diff_schedules(const std::string& reference, const std::string& schedule, const char* name) {
+    FILE* a = fopen(reference.c_str(), "r");
+    FILE* b = fopen(schedule.c_str(), "r");
+    if (a == NULL || b == NULL) {
+        if (a != NULL) fclose(a);
+        if (b != NULL) fclose(b);
+        return -1;
+    }
+    std::vector<std::string> before; // the last lines both had in common
+    char line_a[MAX_LINE_LEN], line_b[MAX_LINE_LEN];
+    long long n = 0, divergence = 0;
+    while (1) {
+        int more_a = read_line(a, line_a);
+        int more_b = read_line(b, line_b);
+        if (!more_a && !more_b) break;
+        n++;
+        if (more_a && more_b && strcmp(line_a, line_b) == 0) {
+            before.push_back(line_a);
+            if ((int)before.size() > context) before.erase(before.begin());
+            continue;
+        }
+        divergence = n;
+        printf("  %s diverges at line %lld:\n", name, divergence);
+        for (size_t i = 0; i < before.size(); i++) printf("      %s\n", before[i].c_str());
+        for (int i = 0; i <= context && (more_a || more_b); i++) {
+            printf("    < %s\n", more_a ? line_a : "(end of schedule)");
+            printf("    > %s\n", more_b ? line_b : "(end of schedule)");
+            more_a = more_a && read_line(a, line_a);
+            more_b = more_b && read_line(b, line_b);
+        }
+        break;
+    }
+    fclose(a);
+    fclose(b);
+    return divergence;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0 || i + 1 >= argc) usage(argv[0]);
+        const char* value = argv[++i];
+        switch (argv[i - 1][1]) {
+            case 'g': gen_path = value; break;
+            case 'n': packets = atoll(value); break;
+            case 'r': runs = atoi(value); break;
+            case 'c': context = atoi(value); break;
+            case 's': only_scenarios.push_back(value); break;
+            case 'i': informational.push_back(value); break;
+            case 'S': resumed.push_back(value); break;
+            case 'k': work_dir = value; keep_files = 1; break;
+            case 'e': {
+                Engine engine;
+                const char* eq = strchr(value, '=');
+                if (eq == NULL || eq[1] == 0) usage(argv[0]);
+                engine.name.assign(value, (size_t)(eq - value));
+                for (const char* word = eq + 1; *word;) {
+                    size_t len = strcspn(word, " ");
+                    if (len > 0) engine.argv.push_back(std::string(word, len));
+                    word += len + (word[len] == ' ');
+                }
+                engine.informational = 0;
+                engine.resumed = 0;
+                engines.push_back(engine);
+                break;
+            }
+            default: usage(argv[0]);
+        }
+    }
+    if (gen_path == NULL || engines.size() < 2 || runs < 1 || context < 0) usage(argv[0]);
+    for (size_t k = 0; k < informational.size(); k++) {
+        for (size_t e = 0; e < engines.size(); e++) engines[e].informational |= (engines[e].name == informational[k]);
+    }
+    for (size_t k = 0; k < resumed.size(); k++) {
+        for (size_t e = 0; e < engines.size(); e++) engines[e].resumed |= (engines[e].name == resumed[k]);
+    }
+
+    if (!keep_files) {
+        char tmpl[] = "/tmp/wfq_diff.XXXXXX";
+        if (mkdtemp(tmpl) == NULL) {
+            perror("mkdtemp");
+            return 1;
+        }
+        work_dir = tmpl;
+    }
+
+    printf("%-16s %4s %-12s %10s %9s %10s %9s  %s\n", "scenario", "seed", "engine", "packets", "wall_s", "Mpkt/s",
+           "rss_MB", "schedule");
+    int failures = 0, informational_diffs = 0;
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+        const Scenario* scenario = &scenarios[s];
+        if (!only_scenarios.empty()) {
+            int wanted = 0;
+            for (size_t k = 0; k < only_scenarios.size(); k++) wanted |= (only_scenarios[k] == scenario->name);
+            if (!wanted) continue;
+        }
+        for (int seed = 1; seed <= runs; seed++) {
+            std::string base = work_dir + "/" + scenario->name + "." + std::to_string(seed);
+            std::string trace = base + ".txt";
+            if (access(trace.c_str(), R_OK) != 0 && !generate(scenario, seed, trace)) {
+                fprintf(stderr, "could not generate %s\n", trace.c_str());
+                return 1;
+            }
+            std::string reference = base + "." + engines[0].name + ".out";
+            // every engine once, then a round trip through a snapshot for the -S ones
+            for (size_t run = 0; run < 2 * engines.size(); run++) {
+                size_t e = run % engines.size();
+                int resume = run >= engines.size();
+                if (resume && !engines[e].resumed) continue;
+                std::string name = engines[e].name + (resume ? "+resume" : "");
+                std::string schedule = base + "." + name + ".out";
+                RunResult r = resume ? run_resumed(&engines[e], trace, schedule, base + "." + name + ".snap")
+                                     : run_engine(&engines[e], trace, schedule, 0);
+                long long divergence = 0;
+                if (run > 0 && r.ok) {
+                    // printed before the row that sums the run up
+                    divergence = diff_schedules(reference, schedule, name.c_str());
+                }
+                long long lines = count_lines(schedule);
+                int expected = engines[e].informational && !resume;
+                const char* verdict = (run == 0) ? "reference" : !r.ok ? "FAILED" : divergence == 0 ? "same"
+                                      : expected ? "differs (expected)" : "DIFFERS";
+                if (!r.ok || (divergence != 0 && !expected)) failures++;
+                informational_diffs += (r.ok && divergence != 0 && expected);
+                printf("%-16s %4d %-12s %10lld %9.3f %10.3f %9.1f  %s\n", scenario->name, seed, name.c_str(),
+                       lines, r.wall_s, lines / r.wall_s / 1e6, r.maxrss_kb / 1024.0, verdict);
+                fflush(stdout);
+            }
+        }
+    }
+    printf("%d failed or diverging runs, %d expected divergences\n", failures, informational_diffs);
+
+    if (!keep_files) {
+        std::string cmd = "rm -rf '" + work_dir + "'";
+        if (system(cmd.c_str()) != 0) fprintf(stderr, "could not remove %s\n", work_dir.c_str());
+    }
+    return failures ? 1 : 0;
+}
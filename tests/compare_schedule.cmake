@@ -0,0 +1,16 @@
+# One regression test: runs PROGRAM [ARGS] < INPUT > OUTPUT and fails unless OUTPUT is byte for byte
+# EXPECTED, a schedule pinned from the original program (see CMakeLists.txt).
+#   cmake -DPROGRAM=path "-DARGS=args" -DINPUT=trace -DEXPECTED=schedule -DOUTPUT=path -P compare_schedule.cmake
+separate_arguments(args UNIX_COMMAND "${ARGS}")
+execute_process(COMMAND ${PROGRAM} ${args}
+        INPUT_FILE ${INPUT}
+        OUTPUT_FILE ${OUTPUT}
+        RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${PROGRAM} ${ARGS} < ${INPUT} failed: ${result}")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT} ${EXPECTED}
+        RESULT_VARIABLE differs)
+if(differs)
+    message(FATAL_ERROR "the schedule in ${OUTPUT} is not the one in ${EXPECTED}")
+endif()
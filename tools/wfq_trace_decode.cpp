@@ -0,0 +1,111 @@
+// Decoder for the event files that WFQ_TRACE builds write with -t (see wfq_trace.h).
+// Prints one line per event, oldest first:
+//   <real_time> <virtual_time> <EVENT> flow=<f> packet=<p> len=<l> <event fields>
+//
+//   wfq_trace_decode [-f flow] [-p packet] [-e event] [-s from_time] [-u until_time] < events
+//
+//   -f  only this flow, can be repeated
+//   -p  only this packet (enqueue order in the scheduler)
+//   -e  only this event: arrival, tags, bus_wait, bus_enter, bus_leave or transmit, can be repeated
+//   -s  only events at or after this real time
+//   -u  only events at or before this real time
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <vector>
+
+#include "wfq_trace.h"
+
+#define READ_BATCH 4096
+
+const char* event_names[WFQ_EV_TYPES] = {"arrival", "tags", "bus_wait", "bus_enter", "bus_leave", "transmit"};
+
+std::vector<int> only_flows;
+std::vector<int> only_types;
+int only_packet = -1;
+double from_time = -1e300;
+double until_time = 1e300;
+
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-f flow] [-p packet] [-e event] [-s from_time] [-u until_time] < events\n", prog);
+    exit(1);
+}
+
+int wanted(const WfqTraceEvent* event) {
+    if (event->real_time < from_time || event->real_time > until_time) return 0;
+    if (only_packet != -1 && event->packet != only_packet) return 0;
+    if (!only_flows.empty()) {
+        int found = 0;
+        for (size_t i = 0; i < only_flows.size(); i++) found |= (only_flows[i] == event->flow);
+        if (!found) return 0;
+    }
+    if (!only_types.empty()) {
+        int found = 0;
+        for (size_t i = 0; i < only_types.size(); i++) found |= (only_types[i] == event->type);
+        if (!found) return 0;
+    }
+    return 1;
+}
+
+void print_event(const WfqTraceEvent* event) {
+    const char* name = (event->type >= 0 && event->type < WFQ_EV_TYPES) ? event_names[event->type] : "unknown";
+    printf("%.17g %.17g %s flow=%d packet=%d len=%d", event->real_time, event->virtual_time, name, event->flow,
+           event->packet, event->length);
+    switch (event->type) {
+        case WFQ_EV_ARRIVAL: printf(" weight=%g\n", event->a); break;
+        case WFQ_EV_TAGS: printf(" vst=%.17g vft=%.17g\n", event->a, event->b); break;
+        case WFQ_EV_BUS_WAIT: printf(" vst=%.17g\n", event->a); break;
+        case WFQ_EV_BUS_ENTER:
+        case WFQ_EV_BUS_LEAVE: printf(" vft=%.17g\n", event->a); break;
+        case WFQ_EV_TRANSMIT: printf(" start=%.17g vft=%.17g\n", event->a, event->b); break;
+        default: printf(" a=%.17g b=%.17g\n", event->a, event->b); break;
+    }
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0 || i + 1 >= argc) usage(argv[0]);
+        const char* value = argv[++i];
+        switch (argv[i - 1][1]) {
+            case 'f': only_flows.push_back(atoi(value)); break;
+            case 'p': only_packet = atoi(value); break;
+            case 's': from_time = atof(value); break;
+            case 'u': until_time = atof(value); break;
+            case 'e': {
+                int type = -1;
+                for (int t = 0; t < WFQ_EV_TYPES; t++) {
+                    if (strcmp(value, event_names[t]) == 0) type = t;
+                }
+                if (type == -1) usage(argv[0]);
+                only_types.push_back(type);
+                break;
+            }
+            default: usage(argv[0]);
+        }
+    }
+
+    WfqTraceHeader header;
+    if (fread(&header, sizeof(header), 1, stdin) != 1 || memcmp(header.magic, WFQ_TRACE_MAGIC, sizeof(WFQ_TRACE_MAGIC)) != 0 ||
+        header.version != WFQ_TRACE_VERSION || header.record_size != (int)sizeof(WfqTraceEvent)) {
+        fprintf(stderr, "not an event file, or one from an incompatible build\n");
+        return 1;
+    }
+    printf("# %llu events recorded, the last %llu follow\n", header.total, header.count);
+
+    std::vector<WfqTraceEvent> batch(READ_BATCH);
+    unsigned long long left = header.count;
+    while (left > 0) {
+        size_t want = (left < READ_BATCH) ? (size_t)left : READ_BATCH;
+        size_t n = fread(&batch[0], sizeof(WfqTraceEvent), want, stdin);
+        for (size_t i = 0; i < n; i++) {
+            if (wanted(&batch[i])) print_event(&batch[i]);
+        }
+        if (n < want) {
+            fprintf(stderr, "truncated event file, %llu events missing\n", left - n);
+            return 1;
+        }
+        left -= n;
+    }
+    return 0;
+}
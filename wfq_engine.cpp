@@ -0,0 +1,933 @@
+#include <cstring>
+
+#include "wfq_engine.h"
+
+void CalendarQueue::push(const HeapEntry& entry) {
+    long long slot = slot_of(entry.key);
+    if (count == 0 || slot < cur_slot) cur_slot = slot;
+    buckets[bucket_of(slot)].push_back(entry);
+    count++;
+    has_top = 0;
+    if (count > 2 * buckets.size()) resize(buckets.size() * 2);
+}
+
+const HeapEntry& CalendarQueue::top() {
+    if (!has_top) find_top();
+    return buckets[top_bucket][top_pos];
+}
+
+void CalendarQueue::pop() {
+    if (!has_top) find_top();
+    std::vector<HeapEntry>& bucket = buckets[top_bucket];
+    bucket[top_pos] = bucket.back();
+    bucket.pop_back();
+    count--;
+    has_top = 0;
+    if (count < buckets.size() / 2 && buckets.size() > CALENDAR_MIN_BUCKETS) resize(buckets.size() / 2);
+}
+
+void CalendarQueue::find_top() {
+    // walk one year of slots from cur_slot, the first slot holding anything holds the minimum
+    vtime_t min_key = 0;
+    int found = 0;
+    long long min_slot = cur_slot;
+    for (size_t i = 0; i < buckets.size() && !found; i++) {
+        long long slot = cur_slot + (long long)i;
+        const std::vector<HeapEntry>& bucket = buckets[bucket_of(slot)];
+        for (size_t k = 0; k < bucket.size(); k++) {
+            if ((!found || bucket[k].key < min_key) && slot_of(bucket[k].key) == slot) {
+                min_key = bucket[k].key;
+                min_slot = slot;
+                found = 1;
+            }
+        }
+    }
+    if (!found) {
+        // nothing within a year, look at everything
+        for (size_t b = 0; b < buckets.size(); b++) {
+            for (size_t k = 0; k < buckets[b].size(); k++) {
+                if (!found || buckets[b][k].key < min_key) min_key = buckets[b][k].key;
+                found = 1;
+            }
+        }
+        min_slot = slot_of(min_key);
+    }
+    cur_slot = min_slot;
+
+    // ties within TIME_EPSILON go by appearance_order, width >= TIME_EPSILON keeps them in two slots
+    int best_order = INT_MAX;
+    for (long long slot = min_slot; slot <= min_slot + 1; slot++) {
+        size_t b = bucket_of(slot);
+        const std::vector<HeapEntry>& bucket = buckets[b];
+        for (size_t k = 0; k < bucket.size(); k++) {
+            if (bucket[k].key - min_key <= TIME_EPSILON && bucket[k].appearance_order < best_order &&
+                slot_of(bucket[k].key) == slot) {
+                best_order = bucket[k].appearance_order;
+                top_bucket = b;
+                top_pos = k;
+            }
+        }
+    }
+    has_top = 1;
+}
+
+// rebucket everything with a width of about three times the average key spacing
+void CalendarQueue::resize(size_t new_size) {
+    std::vector<HeapEntry> all;
+    all.reserve(count);
+    vtime_t lo = 0, hi = 0;
+    for (size_t b = 0; b < buckets.size(); b++) {
+        for (size_t k = 0; k < buckets[b].size(); k++) {
+            if (all.empty() || buckets[b][k].key < lo) lo = buckets[b][k].key;
+            if (all.empty() || buckets[b][k].key > hi) hi = buckets[b][k].key;
+            all.push_back(buckets[b][k]);
+        }
+    }
+    width = (count > 1) ? 3 * (hi - lo) / (vtime_t)count : (vtime_t)1;
+    if (width < CALENDAR_MIN_WIDTH) width = CALENDAR_MIN_WIDTH;
+    buckets.assign(new_size, std::vector<HeapEntry>());
+    for (size_t i = 0; i < all.size(); i++) {
+        buckets[bucket_of(slot_of(all[i].key))].push_back(all[i]);
+    }
+    cur_slot = (count > 0) ? slot_of(lo) : 0;
+    has_top = 0;
+}
+
+WfqScheduler::WfqScheduler() : discipline(DISCIPLINE_WFQ), virtual_time(0), next_departure_time(0), drr_head(-1),
+                               drr_tail(-1), hier_in_service(-1), departures_head(0), last_virtual_change(0),
+                               current_time(0), is_packet_on_bus(0),
+                               sum_active_weight(0), next_appearance_order(0), arrivals_open(0), queued(0) {
+    add_class(-1, 1); // ROOT_CLASS
+}
+
+int WfqScheduler::add_class(int parent, double weight) {
+    ClassNode node;
+    node.parent = parent;
+    node.weight = weight;
+    node.virtual_time = 0;
+    node.sum_backlogged_weight = 0;
+    node.head = -1;
+    node.chosen = -1;
+    node.virtual_start_time = 0;
+    node.virtual_finish_time = 0;
+    classes.push_back(node);
+    return (int)classes.size() - 1;
+}
+
+// The scheduler runs in passes: run the agenda's next step up to the next arrival (see advance()),
+// take every arrival that is due by then, then put a packet on the link if it is free. enqueue() and dequeue() run
+// as many passes as it takes to reach `now`, so the result does not depend on how the caller
+// batches its calls as long as it only calls dequeue(now) once all arrivals up to now are in.
+void WfqScheduler::enqueue(const WfqPacket& packet, long long now) {
+    if (!arrivals_open || RT_FROM_LL(now) > current_time) {
+        if (arrivals_open) schedule_next_packet();
+        while (1) {
+            advance(now);
+            if (RT_FROM_LL(now) <= current_time) break;
+            schedule_next_packet();
+        }
+        arrivals_open = 1;
+    }
+    handle_packet_arrival(packet, now);
+}
+
+int WfqScheduler::dequeue(long long now, WfqDeparture* departure) {
+    if (departures_head == departures.size() && arrivals_open) {
+        arrivals_open = 0;
+        schedule_next_packet();
+    }
+    while (departures_head == departures.size() && queued > 0 &&
+           (now == LLONG_MAX || current_time < RT_FROM_LL(now))) {
+        advance(now);
+        schedule_next_packet();
+    }
+    if (departures_head == departures.size()) return 0;
+    *departure = departures[departures_head++];
+    if (departures_head == departures.size()) {
+        departures.clear();
+        departures_head = 0;
+    }
+    return 1;
+}
+
+long long WfqScheduler::next_event_time() const {
+    if (departures_head < departures.size()) return departures[departures_head].start_time;
+    if (queued == 0) return LLONG_MAX;
+    return RT_TO_LL((next_departure_time > current_time) ? next_departure_time : current_time);
+}
+
+// One step of the agenda up to, but not including, the arrivals at the horizon. Events that fall on
+// the instant the step ends at (several GPS departures with the same finish tag, mostly) run right
+// away as further steps instead of one pass each. Nothing a pass does in between touches the GPS
+// emulation, and the batch stops short of the horizon, so the order of everything that matters is
+// the same.
+void WfqScheduler::advance(long long next_arrival_event_time) {
+    rtime_t horizon = (next_arrival_event_time == LLONG_MAX) ? RT_INFINITY : RT_FROM_LL(next_arrival_event_time);
+    rtime_t when;
+    int events = next_events(horizon, &when);
+    run_events(events, when);
+    while (current_time < horizon && !virtual_bus.empty()) {
+        events = next_events(horizon, &when);
+        if (when != current_time) break;
+        run_events(events, when);
+    }
+}
+
+// The agenda: when the next step ends and the EVENT_ bits of what happens then. The arrivals at the
+// horizon and the link going free end a step at their time, the next GPS departure takes over when
+// it is due by then (within TIME_EPSILON). GPS starts have no time of their own: a waiting packet's
+// start tag is the finish tag of its flow's packet ahead of it, so it becomes due as that one departs,
+// one is flagged whenever the virtual time the step ends at reaches the earliest of them. Jumps over
+// an idle stretch in one step.
+int WfqScheduler::next_events(rtime_t horizon, rtime_t* when) {
+    rtime_t t = horizon;
+    int events = 0;
+    if (next_departure_time < t && is_packet_on_bus) {
+        t = next_departure_time;
+    }
+    if (!virtual_bus.empty()) {
+        rtime_t gps_finish = last_virtual_change + VT_TIMES_WEIGHT(virtual_bus.top().key - virtual_time, sum_active_weight);
+        if (gps_finish <= t + TIME_EPSILON) {
+            t = gps_finish;
+            events |= EVENT_GPS_DEPARTURE;
+        }
+    }
+    if (is_packet_on_bus && t >= next_departure_time) {
+        events |= EVENT_LINK_FREE;
+    }
+    if (!wait_for_virtual_bus.empty()) {
+        // the virtual time progress_virtual_time() will have at t
+        vtime_t then = virtual_time;
+        if (sum_active_weight > TIME_EPSILON) {
+            then += RT_DIV_WEIGHT(t - last_virtual_change, sum_active_weight);
+        }
+        if (wait_for_virtual_bus.top().key <= then + TIME_EPSILON) {
+            events |= EVENT_GPS_START;
+        }
+    }
+    *when = t;
+    return events;
+}
+
+// moves the clocks to when and runs the events, at most one GPS departure and one GPS start as the
+// original main loop did per pass: moving every due start at once changes the rounding of the virtual
+// clock and with it the schedule
+void WfqScheduler::run_events(int events, rtime_t when) {
+    current_time = when;
+    if (discipline == DISCIPLINE_WFQ) {
+        progress_virtual_time();
+        if (events & EVENT_GPS_DEPARTURE) {
+            remove_from_virtual_bus();
+        }
+        if (events & EVENT_GPS_START) {
+            move_to_virtual_bus();
+        }
+    }
+    if (events & EVENT_LINK_FREE) {
+        is_packet_on_bus = 0;
+    }
+}
+
+void WfqScheduler::progress_virtual_time() {
+    if (sum_active_weight > TIME_EPSILON) {
+        virtual_time += RT_DIV_WEIGHT(current_time - last_virtual_change, sum_active_weight);
+    }
+    last_virtual_change = current_time;
+}
+
+FlowState* WfqScheduler::flow_state(int flow) {
+    if (flow >= (int)flows.size()) {
+        FlowState fresh;
+        fresh.weight = 1; // Default weight - THIS MUST BE 1
+        fresh.virtual_finish_time = 0;
+        fresh.ready_head = fresh.ready_tail = -1;
+        fresh.bus_head = fresh.bus_tail = -1;
+        fresh.wait_head = fresh.wait_tail = -1;
+        fresh.deficit = 0;
+        fresh.drr_credited = 0;
+        fresh.next_active = -1;
+        fresh.parent_class = ROOT_CLASS;
+        flows.resize((size_t)flow + 1, fresh);
+    }
+    return &flows[flow];
+}
+
+int WfqScheduler::flow_idle(int flow) const {
+    if (flow >= (int)flows.size()) return 1;
+    const FlowState* state = &flows[flow];
+    if (state->ready_head != -1 || state->bus_head != -1 || state->wait_head != -1) return 0;
+    // the next start tag is max(virtual time, finish tag), HWFQ uses the clock of the flow's class
+    vtime_t now = (discipline == DISCIPLINE_HWFQ) ? classes[state->parent_class].virtual_time : virtual_time;
+    return state->virtual_finish_time <= now;
+}
+
+double WfqScheduler::reset_flow(int flow) {
+    if (flow >= (int)flows.size()) return 1;
+    double weight = flows[flow].weight;
+    flows[flow].weight = 1;
+    flows[flow].virtual_finish_time = 0;
+    flows[flow].deficit = 0;
+    flows[flow].drr_credited = 0;
+    flows[flow].next_active = -1;
+    flows[flow].parent_class = ROOT_CLASS;
+    return weight;
+}
+
+void WfqScheduler::handle_packet_arrival(const WfqPacket& packet, long long now) {
+    FlowState* flow = flow_state(packet.flow);
+    QueuedPacket queued_packet;
+    queued_packet.arrival_time = now;
+    queued_packet.cookie = packet.cookie;
+    queued_packet.length = packet.length;
+    queued_packet.flow = packet.flow;
+    queued_packet.appearance_order = next_appearance_order++;
+    if (packet.weight != NO_WEIGHT) {
+        flow->weight = packet.weight;
+    }
+    queued_packet.weight = flow->weight; //if packet does not have a specified weight, take the flow's at the time
+    queued++;
+    WFQ_TRACE_EVENT(WFQ_EV_ARRIVAL, &queued_packet, queued_packet.weight, 0);
+
+    if (discipline == DISCIPLINE_WF2QPLUS) {
+        // tags are given to the head of the flow only, when it gets there
+        int idx = store_packet(queued_packet);
+        if (append_to_flow(idx)) {
+            QueuedPacket* head = &packet_pool[idx];
+            head->virtual_start_time = (virtual_time > flow->virtual_finish_time) ? virtual_time : flow->virtual_finish_time;
+            head->virtual_finish_time = head->virtual_start_time + VT_LEN_OVER_WEIGHT(head->length, head->weight);
+            flow->virtual_finish_time = head->virtual_finish_time;
+            WFQ_TRACE_EVENT(WFQ_EV_TAGS, head, VT_TO_DOUBLE(head->virtual_start_time), VT_TO_DOUBLE(head->virtual_finish_time));
+            sum_active_weight += WEIGHT_FIXED(head->weight);
+            push_wf2qplus_head(idx);
+        }
+        return;
+    }
+    if (discipline == DISCIPLINE_HWFQ) {
+        // as WF2Q+ within the flow's class, the classes above only notice a flow that was idle
+        int idx = store_packet(queued_packet);
+        if (append_to_flow(idx)) {
+            QueuedPacket* head = &packet_pool[idx];
+            const ClassNode* node = &classes[flow->parent_class];
+            head->virtual_start_time = (node->virtual_time > flow->virtual_finish_time) ? node->virtual_time : flow->virtual_finish_time;
+            head->virtual_finish_time = head->virtual_start_time + VT_LEN_OVER_WEIGHT(head->length, head->weight);
+            flow->virtual_finish_time = head->virtual_finish_time;
+            WFQ_TRACE_EVENT(WFQ_EV_TAGS, head, VT_TO_DOUBLE(head->virtual_start_time), VT_TO_DOUBLE(head->virtual_finish_time));
+            activate_child(flow->parent_class, packet.flow, head->virtual_start_time, head->virtual_finish_time,
+                           WEIGHT_FIXED(head->weight));
+        }
+        return;
+    }
+    if (discipline == DISCIPLINE_DRR) {
+        int idx = store_packet(queued_packet);
+        if (append_to_flow(idx)) {
+            // joins the end of the round
+            flow->next_active = -1;
+            if (drr_tail == -1) {
+                drr_head = packet.flow;
+            } else {
+                flows[drr_tail].next_active = packet.flow;
+            }
+            drr_tail = packet.flow;
+        }
+        return;
+    }
+
+    // WFQ and SCFQ stamp every packet on arrival
+    vtime_t virtual_start = (virtual_time > flow->virtual_finish_time) ? virtual_time : flow->virtual_finish_time;
+    queued_packet.virtual_start_time = virtual_start;
+    queued_packet.virtual_finish_time = virtual_start + VT_LEN_OVER_WEIGHT(packet.length, flow->weight);
+    flow->virtual_finish_time = queued_packet.virtual_finish_time;
+    WFQ_TRACE_EVENT(WFQ_EV_TAGS, &queued_packet, VT_TO_DOUBLE(virtual_start), VT_TO_DOUBLE(queued_packet.virtual_finish_time));
+
+    int idx = store_packet(queued_packet);
+    enqueue_ready(idx);
+    if (discipline != DISCIPLINE_WFQ) {
+        return;
+    }
+    if (virtual_start != virtual_time) {
+        add_to_wait_for_virtual_bus(idx);
+    } else {
+        add_to_virtual_bus(idx);
+    }
+}
+
+// puts the discipline's next packet on the link if the link is free
+void WfqScheduler::schedule_next_packet() {
+    if (queued == 0 || next_departure_time > current_time || is_packet_on_bus) return;
+
+    int idx;
+    switch (discipline) {
+        case DISCIPLINE_SCFQ:
+            idx = dequeue_ready();
+            virtual_time = packet_pool[idx].virtual_finish_time; // the self clock: finish tag of the packet in service
+            break;
+        case DISCIPLINE_WF2QPLUS:
+            idx = pick_wf2qplus();
+            break;
+        case DISCIPLINE_DRR:
+            idx = pick_drr();
+            break;
+        case DISCIPLINE_HWFQ:
+            idx = pick_hierarchical();
+            break;
+        default:
+            idx = dequeue_ready();
+            break;
+    }
+    const QueuedPacket* packet_to_send = &packet_pool[idx];
+    is_packet_on_bus = 1;
+
+    // Determine actual start time for this packet
+    // next_departure_time holds when the server became free from the previous transmission (or 0 if idle)
+    long long actual_start_time = (next_departure_time > RT_FROM_LL(packet_to_send->arrival_time)) ? RT_TO_LL(next_departure_time) : packet_to_send->arrival_time;
+
+    WfqDeparture departure;
+    departure.start_time = actual_start_time;
+    departure.arrival_time = packet_to_send->arrival_time;
+    departure.flow = packet_to_send->flow;
+    departure.length = packet_to_send->length;
+    departure.cookie = packet_to_send->cookie;
+    departures.push_back(departure);
+    queued--;
+    WFQ_TRACE_EVENT(WFQ_EV_TRANSMIT, packet_to_send, (double)actual_start_time,
+                    (discipline == DISCIPLINE_DRR) ? 0 : VT_TO_DOUBLE(packet_to_send->virtual_finish_time));
+
+    // Update server's next free time
+    next_departure_time = RT_FROM_LL(actual_start_time + packet_to_send->length);
+    release_packet(idx);
+}
+
+int WfqScheduler::store_packet(const QueuedPacket& packet) {
+    int idx;
+    if (!free_packet_slots.empty()) {
+        idx = free_packet_slots.back();
+        free_packet_slots.pop_back();
+        packet_pool[idx] = packet;
+    } else {
+        idx = (int)packet_pool.size();
+        packet_pool.push_back(packet);
+    }
+    packet_pool[idx].next_ready = -1;
+    packet_pool[idx].next_gps = -1;
+    // WFQ: real queue + GPS emulation, HWFQ: real queue + the class heads until the link frees up
+    packet_pool[idx].refs = (discipline == DISCIPLINE_WFQ || discipline == DISCIPLINE_HWFQ) ? 2 : 1;
+    return idx;
+}
+
+void WfqScheduler::release_packet(int idx) {
+    if (--packet_pool[idx].refs == 0) {
+        free_packet_slots.push_back(idx);
+    }
+}
+
+HeapEntry WfqScheduler::make_entry(vtime_t key, int idx) const {
+    HeapEntry entry;
+    entry.key = key;
+    entry.appearance_order = packet_pool[idx].appearance_order;
+    entry.packet = idx;
+    return entry;
+}
+
+// appends to the flow's FIFO of packets waiting for the link, returns 1 if it is the new head
+int WfqScheduler::append_to_flow(int idx) {
+    FlowState* flow = &flows[packet_pool[idx].flow];
+    int was_empty = (flow->ready_tail == -1);
+    if (was_empty) {
+        flow->ready_head = idx;
+    } else {
+        packet_pool[flow->ready_tail].next_ready = idx;
+    }
+    flow->ready_tail = idx;
+    return was_empty;
+}
+
+// takes the head idx off its flow's FIFO, returns the new head or -1
+int WfqScheduler::pop_from_flow(int idx) {
+    FlowState* flow = &flows[packet_pool[idx].flow];
+    flow->ready_head = packet_pool[idx].next_ready;
+    if (flow->ready_head == -1) {
+        flow->ready_tail = -1;
+    }
+    return flow->ready_head;
+}
+
+void WfqScheduler::enqueue_ready(int idx) {
+    if (append_to_flow(idx)) {
+        ready_queue.push(make_entry(packet_pool[idx].virtual_finish_time, idx));
+    }
+}
+
+// pops the packet with the smallest VFT and puts its flow's next packet in the heap
+int WfqScheduler::dequeue_ready() {
+    int idx = ready_queue.top().packet;
+    ready_queue.pop();
+    int next = pop_from_flow(idx);
+    if (next != -1) {
+        ready_queue.push(make_entry(packet_pool[next].virtual_finish_time, next));
+    }
+    return idx;
+}
+
+// WF2Q+ keeps flow heads in ready_queue by finish tag once their start tag is due, before that in
+// ineligible_queue by start tag
+void WfqScheduler::push_wf2qplus_head(int idx) {
+    if (packet_pool[idx].virtual_start_time <= virtual_time + TIME_EPSILON) {
+        ready_queue.push(make_entry(packet_pool[idx].virtual_finish_time, idx));
+    } else {
+        ineligible_queue.push(make_entry(packet_pool[idx].virtual_start_time, idx));
+    }
+}
+
+// V = max(V + sent / backlogged weight, smallest start tag), then the smallest finish tag among
+// the eligible heads goes
+int WfqScheduler::pick_wf2qplus() {
+    if (ready_queue.empty() && ineligible_queue.top().key > virtual_time) {
+        virtual_time = ineligible_queue.top().key;
+    }
+    while (!ineligible_queue.empty() && ineligible_queue.top().key <= virtual_time + TIME_EPSILON) {
+        int head = ineligible_queue.top().packet;
+        ineligible_queue.pop();
+        ready_queue.push(make_entry(packet_pool[head].virtual_finish_time, head));
+    }
+    int idx = ready_queue.top().packet;
+    ready_queue.pop();
+    const QueuedPacket* packet = &packet_pool[idx];
+    FlowState* flow = &flows[packet->flow];
+    vtime_t elapsed = (sum_active_weight > 0) ? VT_LEN_OVER_WEIGHT_SUM(packet->length, sum_active_weight) : 0;
+    sum_active_weight -= WEIGHT_FIXED(packet->weight);
+
+    int next = pop_from_flow(idx);
+    if (next != -1) {
+        QueuedPacket* head = &packet_pool[next];
+        head->virtual_start_time = flow->virtual_finish_time;
+        head->virtual_finish_time = head->virtual_start_time + VT_LEN_OVER_WEIGHT(head->length, head->weight);
+        flow->virtual_finish_time = head->virtual_finish_time;
+        WFQ_TRACE_EVENT(WFQ_EV_TAGS, head, VT_TO_DOUBLE(head->virtual_start_time), VT_TO_DOUBLE(head->virtual_finish_time));
+        sum_active_weight += WEIGHT_FIXED(head->weight);
+    }
+    virtual_time += elapsed;
+    if (next != -1) {
+        push_wf2qplus_head(next);
+    }
+    return idx;
+}
+
+// DRR: the flow at the front of the round sends while its deficit covers the head packet, then
+// goes to the back. A flow that empties leaves the round and its deficit is dropped.
+int WfqScheduler::pick_drr() {
+    while (1) {
+        int f = drr_head;
+        FlowState* flow = &flows[f];
+        int idx = flow->ready_head;
+        if (!flow->drr_credited) {
+            double quantum = packet_pool[idx].weight * DRR_QUANTUM;
+            flow->deficit += (quantum < 1) ? 1 : quantum;
+            flow->drr_credited = 1;
+        }
+        if (packet_pool[idx].length <= flow->deficit) {
+            flow->deficit -= packet_pool[idx].length;
+            if (pop_from_flow(idx) == -1) {
+                flow->deficit = 0;
+                flow->drr_credited = 0;
+                drr_head = flow->next_active;
+                if (drr_head == -1) drr_tail = -1;
+                flow->next_active = -1;
+            }
+            return idx;
+        }
+        flow->drr_credited = 0;
+        if (flow->next_active != -1) {
+            drr_head = flow->next_active;
+            flow->next_active = -1;
+            flows[drr_tail].next_active = f;
+            drr_tail = f;
+        }
+    }
+}
+
+// HWFQ: sends the root's head. The classes on its path pick their next heads only when the link
+// frees up again, so that whatever arrives in the meantime competes.
+int WfqScheduler::pick_hierarchical() {
+    if (hier_in_service != -1) {
+        reset_path(hier_in_service);
+    }
+    hier_in_service = classes[ROOT_CLASS].head;
+    return hier_in_service;
+}
+
+// child (flow or CLASS_CHILD) of class_id went from idle to backlogged, pass it up as far as the
+// classes above were idle too
+void WfqScheduler::activate_child(int class_id, int child, vtime_t start, vtime_t finish, weight_t weight) {
+    while (1) {
+        ClassNode* node = &classes[class_id];
+        node->sum_backlogged_weight += weight;
+        if (node->head != -1) {
+            push_child(node, child, start, finish);
+            return;
+        }
+        // the class was idle, the new child is all it has
+        if (start > node->virtual_time) node->virtual_time = start;
+        node->chosen = child;
+        node->head = child_head(child);
+        if (node->parent == -1) return;
+
+        const ClassNode* parent = &classes[node->parent];
+        start = (parent->virtual_time > node->virtual_finish_time) ? parent->virtual_time : node->virtual_finish_time;
+        finish = start + VT_LEN_OVER_WEIGHT(packet_pool[node->head].length, node->weight);
+        node->virtual_start_time = start;
+        node->virtual_finish_time = finish;
+        weight = WEIGHT_FIXED(node->weight);
+        child = CLASS_CHILD(class_id);
+        class_id = node->parent;
+    }
+}
+
+// idx has been sent: from its flow up to the root every class advances its clock, puts the child
+// that was served back with new tags if it is still backlogged and picks its next head
+void WfqScheduler::reset_path(int idx) {
+    const QueuedPacket* sent = &packet_pool[idx];
+    FlowState* flow = &flows[sent->flow];
+    weight_t old_weight = WEIGHT_FIXED(sent->weight);
+    weight_t new_weight = 0;
+    vtime_t start = 0, finish = 0;
+    int next = pop_from_flow(idx);
+    int backlogged = (next != -1);
+    if (backlogged) {
+        QueuedPacket* head = &packet_pool[next];
+        head->virtual_start_time = flow->virtual_finish_time;
+        head->virtual_finish_time = head->virtual_start_time + VT_LEN_OVER_WEIGHT(head->length, head->weight);
+        flow->virtual_finish_time = head->virtual_finish_time;
+        WFQ_TRACE_EVENT(WFQ_EV_TAGS, head, VT_TO_DOUBLE(head->virtual_start_time), VT_TO_DOUBLE(head->virtual_finish_time));
+        start = head->virtual_start_time;
+        finish = head->virtual_finish_time;
+        new_weight = WEIGHT_FIXED(head->weight);
+    }
+
+    int child = sent->flow;
+    int class_id = flow->parent_class;
+    while (1) {
+        ClassNode* node = &classes[class_id];
+        vtime_t elapsed = (node->sum_backlogged_weight > 0) ? VT_LEN_OVER_WEIGHT_SUM(sent->length, node->sum_backlogged_weight) : 0;
+        node->sum_backlogged_weight -= old_weight;
+        node->virtual_time += elapsed;
+        if (backlogged) {
+            node->sum_backlogged_weight += new_weight;
+            push_child(node, child, start, finish);
+        }
+        select_child(node);
+        if (node->parent == -1) break;
+
+        // the class itself was the child served in its parent
+        backlogged = (node->head != -1);
+        old_weight = new_weight = WEIGHT_FIXED(node->weight);
+        if (backlogged) {
+            start = node->virtual_finish_time;
+            finish = start + VT_LEN_OVER_WEIGHT(packet_pool[node->head].length, node->weight);
+            node->virtual_start_time = start;
+            node->virtual_finish_time = finish;
+        }
+        child = CLASS_CHILD(class_id);
+        class_id = node->parent;
+    }
+    release_packet(idx);
+}
+
+void WfqScheduler::push_child(ClassNode* node, int child, vtime_t start, vtime_t finish) {
+    HeapEntry entry;
+    entry.appearance_order = packet_pool[child_head(child)].appearance_order;
+    entry.packet = child;
+    if (start <= node->virtual_time + TIME_EPSILON) {
+        entry.key = finish;
+        node->eligible.push(entry);
+    } else {
+        entry.key = start;
+        node->ineligible.push(entry);
+    }
+}
+
+// WF2Q+ within the class: catch the clock up with the earliest start tag if nothing is eligible,
+// make everything that is due eligible, the smallest finish tag wins
+void WfqScheduler::select_child(ClassNode* node) {
+    if (node->eligible.empty() && node->ineligible.empty()) {
+        node->head = -1;
+        node->chosen = -1;
+        return;
+    }
+    if (node->eligible.empty() && node->ineligible.top().key > node->virtual_time) {
+        node->virtual_time = node->ineligible.top().key;
+    }
+    while (!node->ineligible.empty() && node->ineligible.top().key <= node->virtual_time + TIME_EPSILON) {
+        HeapEntry entry = node->ineligible.top();
+        node->ineligible.pop();
+        entry.key = (entry.packet >= 0) ? packet_pool[flows[entry.packet].ready_head].virtual_finish_time
+                                        : classes[CLASS_CHILD(entry.packet)].virtual_finish_time;
+        node->eligible.push(entry);
+    }
+    node->chosen = node->eligible.top().packet;
+    node->eligible.pop();
+    node->head = child_head(node->chosen);
+}
+
+int WfqScheduler::child_head(int child) const {
+    return (child >= 0) ? flows[child].ready_head : classes[CLASS_CHILD(child)].head;
+}
+
+void WfqScheduler::remove_from_virtual_bus() {
+    int idx = virtual_bus.top().packet;
+    QueuedPacket* packet = &packet_pool[idx];
+    WFQ_TRACE_EVENT(WFQ_EV_BUS_LEAVE, packet, VT_TO_DOUBLE(packet->virtual_finish_time), 0);
+    sum_active_weight -= WEIGHT_FIXED(packet->weight);
+    virtual_bus.pop();
+    if (packet->next_gps != SOLO_ON_BUS) {
+        FlowState* flow = &flows[packet->flow];
+        flow->bus_head = packet->next_gps;
+        if (flow->bus_head == -1) {
+            flow->bus_tail = -1;
+        } else {
+            virtual_bus.push(make_entry(packet_pool[flow->bus_head].virtual_finish_time, flow->bus_head));
+        }
+    }
+    release_packet(idx);
+}
+
+void WfqScheduler::add_to_virtual_bus(int idx) {
+    QueuedPacket* packet_to_add = &packet_pool[idx];
+    FlowState* flow = &flows[packet_to_add->flow];
+    HeapEntry entry = make_entry(packet_to_add->virtual_finish_time, idx);
+    WFQ_TRACE_EVENT(WFQ_EV_BUS_ENTER, packet_to_add, VT_TO_DOUBLE(packet_to_add->virtual_finish_time), 0);
+    sum_active_weight += WEIGHT_FIXED(packet_to_add->weight);
+    packet_to_add->next_gps = -1;
+    if (flow->bus_tail == -1) {
+        flow->bus_head = idx;
+        flow->bus_tail = idx;
+        virtual_bus.push(entry);
+    } else if (CompareByKey()(entry, make_entry(packet_pool[flow->bus_tail].virtual_finish_time, flow->bus_tail))) {
+        packet_pool[flow->bus_tail].next_gps = idx;
+        flow->bus_tail = idx;
+    } else {
+        // only zero length packets can overtake their flow on the bus, give it its own entry
+        packet_to_add->next_gps = SOLO_ON_BUS;
+        virtual_bus.push(entry);
+    }
+}
+
+void WfqScheduler::add_to_wait_for_virtual_bus(int idx) {
+    FlowState* flow = &flows[packet_pool[idx].flow];
+    WFQ_TRACE_EVENT(WFQ_EV_BUS_WAIT, &packet_pool[idx], VT_TO_DOUBLE(packet_pool[idx].virtual_start_time), 0);
+    packet_pool[idx].next_gps = -1;
+    if (flow->wait_tail == -1) {
+        flow->wait_head = idx;
+        wait_for_virtual_bus.push(make_entry(packet_pool[idx].virtual_start_time, idx));
+    } else {
+        packet_pool[flow->wait_tail].next_gps = idx;
+    }
+    flow->wait_tail = idx;
+}
+
+void WfqScheduler::move_to_virtual_bus() {
+    int idx = wait_for_virtual_bus.top().packet;
+    wait_for_virtual_bus.pop();
+    FlowState* flow = &flows[packet_pool[idx].flow];
+    flow->wait_head = packet_pool[idx].next_gps;
+    if (flow->wait_head == -1) {
+        flow->wait_tail = -1;
+    } else {
+        wait_for_virtual_bus.push(make_entry(packet_pool[flow->wait_head].virtual_start_time, flow->wait_head));
+    }
+    add_to_virtual_bus(idx);
+}
+
+// Checkpoint encoding: the fields in a fixed order, native byte order, a vector as its size and
+// then its items. The layout tag rejects states from builds with other types or queues.
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_LAYOUT (CHECKPOINT_VERSION << 24 | (FIXED_POINT_VTIME << 1 | CALENDAR_QUEUE) << 16 | \
+                           (int)sizeof(QueuedPacket) << 8 | (int)sizeof(FlowState))
+
+struct CheckpointReader {
+    const char* p;
+    const char* end;
+    int ok;
+
+    void get_bytes(void* dst, size_t size) {
+        if (!ok || (size_t)(end - p) < size) {
+            ok = 0;
+            return;
+        }
+        memcpy(dst, p, size);
+        p += size;
+    }
+    template <typename T> void get(T* value) { get_bytes(value, sizeof(T)); }
+    template <typename T> void get_vector(std::vector<T>* items) {
+        unsigned long long n = 0;
+        get(&n);
+        if (!ok || n > (unsigned long long)(end - p) / sizeof(T)) {
+            ok = 0;
+            return;
+        }
+        items->resize((size_t)n);
+        if (n > 0) get_bytes(&(*items)[0], (size_t)n * sizeof(T));
+    }
+};
+
+static void put_bytes(std::vector<char>* out, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    out->insert(out->end(), p, p + size);
+}
+
+template <typename T> static void put(std::vector<char>* out, const T& value) {
+    put_bytes(out, &value, sizeof(T));
+}
+
+template <typename T> static void put_vector(std::vector<char>* out, const std::vector<T>& items) {
+    put(out, (unsigned long long)items.size());
+    if (!items.empty()) put_bytes(out, &items[0], items.size() * sizeof(T));
+}
+
+#if CALENDAR_QUEUE
+static void put_queue(std::vector<char>* out, const CalendarQueue& queue) {
+    put(out, (unsigned long long)queue.buckets.size());
+    for (size_t b = 0; b < queue.buckets.size(); b++) put_vector(out, queue.buckets[b]);
+    put(out, (unsigned long long)queue.count);
+    put(out, queue.width);
+    put(out, queue.cur_slot);
+    put(out, queue.has_top);
+    put(out, (unsigned long long)queue.top_bucket);
+    put(out, (unsigned long long)queue.top_pos);
+}
+
+static void get_queue(CheckpointReader* in, CalendarQueue* queue) {
+    unsigned long long num_buckets = 0, count = 0, top_bucket = 0, top_pos = 0;
+    in->get(&num_buckets);
+    if (!in->ok || num_buckets == 0 || (num_buckets & (num_buckets - 1)) != 0 || num_buckets > (unsigned long long)(in->end - in->p)) {
+        in->ok = 0;
+        return;
+    }
+    queue->buckets.assign((size_t)num_buckets, std::vector<HeapEntry>());
+    for (size_t b = 0; b < queue->buckets.size() && in->ok; b++) in->get_vector(&queue->buckets[b]);
+    in->get(&count);
+    in->get(&queue->width);
+    in->get(&queue->cur_slot);
+    in->get(&queue->has_top);
+    in->get(&top_bucket);
+    in->get(&top_pos);
+    queue->count = (size_t)count;
+    queue->top_bucket = (size_t)top_bucket;
+    queue->top_pos = (size_t)top_pos;
+    if (queue->has_top && (top_bucket >= num_buckets || top_pos >= queue->buckets[(size_t)top_bucket].size())) in->ok = 0;
+}
+#else
+static void put_queue(std::vector<char>* out, const EntryHeap& queue) {
+    put_vector(out, queue.items());
+}
+
+static void get_queue(CheckpointReader* in, EntryHeap* queue) {
+    in->get_vector(&queue->items());
+}
+#endif
+
+void WfqScheduler::save(std::vector<char>* out) const {
+    put(out, (int)CHECKPOINT_LAYOUT);
+    put(out, discipline);
+    put_vector(out, flows);
+    put(out, virtual_time);
+    put(out, next_departure_time);
+    put_queue(out, ready_queue);
+    put_queue(out, virtual_bus);
+    put_queue(out, wait_for_virtual_bus);
+    put_queue(out, ineligible_queue);
+    put(out, drr_head);
+    put(out, drr_tail);
+    put(out, (unsigned long long)classes.size());
+    for (size_t c = 0; c < classes.size(); c++) {
+        const ClassNode* node = &classes[c];
+        put(out, node->parent);
+        put(out, node->weight);
+        put(out, node->virtual_time);
+        put(out, node->sum_backlogged_weight);
+        put(out, node->head);
+        put(out, node->chosen);
+        put(out, node->virtual_start_time);
+        put(out, node->virtual_finish_time);
+        put_queue(out, node->eligible);
+        put_queue(out, node->ineligible);
+    }
+    put(out, hier_in_service);
+    put_vector(out, packet_pool);
+    put_vector(out, free_packet_slots);
+    put_vector(out, std::vector<WfqDeparture>(departures.begin() + departures_head, departures.end()));
+    put(out, last_virtual_change);
+    put(out, current_time);
+    put(out, is_packet_on_bus);
+    put(out, sum_active_weight);
+    put(out, next_appearance_order);
+    put(out, arrivals_open);
+    put(out, (unsigned long long)queued);
+}
+
+int WfqScheduler::load(const char* data, size_t size) {
+    CheckpointReader in;
+    in.p = data;
+    in.end = data + size;
+    in.ok = 1;
+    int layout = 0;
+    in.get(&layout);
+    if (layout != CHECKPOINT_LAYOUT) return 0;
+
+    // everything goes into a copy first, so a bad checkpoint leaves this scheduler as it was
+    WfqScheduler s;
+    unsigned long long num_classes = 0, num_queued = 0;
+    in.get(&s.discipline);
+    in.get_vector(&s.flows);
+    in.get(&s.virtual_time);
+    in.get(&s.next_departure_time);
+    get_queue(&in, &s.ready_queue);
+    get_queue(&in, &s.virtual_bus);
+    get_queue(&in, &s.wait_for_virtual_bus);
+    get_queue(&in, &s.ineligible_queue);
+    in.get(&s.drr_head);
+    in.get(&s.drr_tail);
+    in.get(&num_classes);
+    if (!in.ok || num_classes == 0 || num_classes > (unsigned long long)(in.end - in.p)) return 0;
+    s.classes.resize((size_t)num_classes);
+    for (size_t c = 0; c < s.classes.size() && in.ok; c++) {
+        ClassNode* node = &s.classes[c];
+        in.get(&node->parent);
+        in.get(&node->weight);
+        in.get(&node->virtual_time);
+        in.get(&node->sum_backlogged_weight);
+        in.get(&node->head);
+        in.get(&node->chosen);
+        in.get(&node->virtual_start_time);
+        in.get(&node->virtual_finish_time);
+        get_queue(&in, &node->eligible);
+        get_queue(&in, &node->ineligible);
+    }
+    in.get(&s.hier_in_service);
+    in.get_vector(&s.packet_pool);
+    in.get_vector(&s.free_packet_slots);
+    in.get_vector(&s.departures);
+    in.get(&s.last_virtual_change);
+    in.get(&s.current_time);
+    in.get(&s.is_packet_on_bus);
+    in.get(&s.sum_active_weight);
+    in.get(&s.next_appearance_order);
+    in.get(&s.arrivals_open);
+    in.get(&num_queued);
+    if (!in.ok || in.p != in.end) return 0;
+    s.departures_head = 0;
+    s.queued = (size_t)num_queued;
+#if WFQ_TRACE
+    s.trace = trace;
+#endif
+    *this = s;
+    return 1;
+}
+
+void WfqScheduler::held_cookies(std::vector<unsigned long long>* out) const {
+    for (size_t f = 0; f < flows.size(); f++) {
+        for (int idx = flows[f].ready_head; idx != -1; idx = packet_pool[idx].next_ready) {
+            if (idx != hier_in_service) out->push_back(packet_pool[idx].cookie); // HWFQ leaves the sent one at the head
+        }
+    }
+    for (size_t i = departures_head; i < departures.size(); i++) out->push_back(departures[i].cookie);
+}
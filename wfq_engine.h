@@ -0,0 +1,324 @@
+// WFQ scheduling core: packet-by-packet WFQ over one link that sends one byte per time unit,
+// with the GPS reference system emulated through virtual_bus / wait_for_virtual_bus. Cheaper
+// disciplines with weaker fairness bounds can be picked with set_discipline():
+//   DISCIPLINE_SCFQ     self-clocked fair queueing, virtual time is the finish tag in service
+//   DISCIPLINE_WF2QPLUS WF2Q+, smallest finish tag among the packets whose start tag is due
+//   DISCIPLINE_DRR      deficit round robin, weight * DRR_QUANTUM bytes per flow and round
+//   DISCIPLINE_HWFQ     hierarchical WFQ (H-WF2Q+) over the classes from add_class()
+// None of them needs the GPS emulation, SCFQ and WF2Q+ are O(log flows), DRR is O(1) and
+// H-WF2Q+ is O(depth * log fan-out).
+// No I/O and no globals, each WfqScheduler is independent. All containers only ever grow and
+// are reused, so once a run has seen its peak backlog enqueue/dequeue no longer allocate.
+//
+//   WfqScheduler s;
+//   s.enqueue(packet, now);              // a packet arrives at `now`
+//   while (s.dequeue(now, &departure))   // everything that starts transmitting by `now`
+//       ...
+//   s.next_event_time();                 // when to call dequeue() next if nothing arrives
+//
+// Times passed to dequeue must not go backwards. enqueue may get a time before the last one: the
+// packet joins the arrivals being taken in and keeps its own arrival time, so it starts sending as
+// early as that if the link was free then, and the clocks can step back to it. That is what the
+// original main loop did with input not sorted by time. Builds with -DWFQ_TRACE=1 record what the
+// scheduler does in a ring buffer, see wfq_trace.h.
+#ifndef WFQ_ENGINE_H
+#define WFQ_ENGINE_H
+
+#include <cmath>
+#include <climits>
+#include <queue>
+#include <vector>
+#include <functional>
+
+#include "wfq_trace.h"
+
+#define EPSILON 1e-9
+
+// Virtual clock representation, build with -DFIXED_POINT_VTIME=1 for exact integer arithmetic:
+// weights in units of 2^-WEIGHT_FRAC_BITS, virtual time in 2^-VT_FRAC_BITS and real time in
+// 2^-(VT_FRAC_BITS + WEIGHT_FRAC_BITS) so that (virtual time) * (weight) is a real time with no
+// rounding and the GPS departure instant lands exactly on the packet's VFT. The weight sum is an
+// integer so it does not drift, and all comparisons are exact (TIME_EPSILON is 0).
+#ifndef FIXED_POINT_VTIME
+#define FIXED_POINT_VTIME 0
+#endif
+#if FIXED_POINT_VTIME
+#define WEIGHT_FRAC_BITS 16
+#define VT_FRAC_BITS 32
+typedef __int128 vtime_t;
+typedef __int128 rtime_t;
+typedef long long weight_t;
+#define TIME_EPSILON 0
+#define WEIGHT_FIXED(w) ((weight_t)llround((w) * (double)(1LL << WEIGHT_FRAC_BITS)))
+#define VT_LEN_OVER_WEIGHT(len, w) ((((vtime_t)(len)) << (VT_FRAC_BITS + WEIGHT_FRAC_BITS)) / WEIGHT_FIXED(w))
+#define VT_LEN_OVER_WEIGHT_SUM(len, sum) ((((vtime_t)(len)) << (VT_FRAC_BITS + WEIGHT_FRAC_BITS)) / (sum)) // sum already fixed
+#define RT_DIV_WEIGHT(dt, w) ((vtime_t)((dt) / (w)))
+#define VT_TIMES_WEIGHT(dv, w) ((rtime_t)((dv) * (w)))
+#define RT_FROM_LL(t) (((rtime_t)(t)) << (VT_FRAC_BITS + WEIGHT_FRAC_BITS))
+#define RT_TO_LL(t) ((long long)((t) >> (VT_FRAC_BITS + WEIGHT_FRAC_BITS)))
+#define RT_TO_DOUBLE(t) ((double)(t) / 281474976710656.0) // 2^48
+#define VT_TO_DOUBLE(v) ((double)(v) / 4294967296.0) // 2^32
+#define WEIGHT_TO_DOUBLE(w) ((double)(w) / (double)(1LL << WEIGHT_FRAC_BITS))
+#define RT_INFINITY ((rtime_t)(((unsigned __int128)1 << 127) - 1))
+#else
+typedef double vtime_t;
+typedef double rtime_t;
+typedef double weight_t;
+#define TIME_EPSILON EPSILON
+#define WEIGHT_FIXED(w) (w)
+#define VT_LEN_OVER_WEIGHT(len, w) ((double)(len) / (w))
+#define VT_LEN_OVER_WEIGHT_SUM(len, sum) ((double)(len) / (sum))
+#define RT_DIV_WEIGHT(dt, w) ((double)(dt) / (w))
+#define VT_TIMES_WEIGHT(dv, w) ((dv) * (w))
+#define RT_FROM_LL(t) ((double)(t))
+#define RT_TO_LL(t) ((long long)(t))
+#define RT_TO_DOUBLE(t) (t)
+#define VT_TO_DOUBLE(v) (v)
+#define WEIGHT_TO_DOUBLE(w) (w)
+#define RT_INFINITY ((double)LLONG_MAX)
+#endif
+#define NO_WEIGHT (-1.0)
+#define DISCIPLINE_WFQ 0
+#define DISCIPLINE_SCFQ 1
+#define DISCIPLINE_WF2QPLUS 2
+#define DISCIPLINE_DRR 3
+#define DISCIPLINE_HWFQ 4
+#define DRR_QUANTUM 1500
+#define ROOT_CLASS 0
+#define CLASS_CHILD(c) (~(c)) // a class's heaps refer to flows as f >= 0 and to child classes as ~c
+#define SOLO_ON_BUS (-2) // on the virtual bus with its own heap entry, not in the flow's list
+// what happens when a step of the scheduler's agenda ends, several can fall on the same instant. A
+// step that ends at the caller's next arrival has none of them, the caller enqueues the arrivals
+#define EVENT_LINK_FREE 1 // the packet on the link has been sent
+#define EVENT_GPS_DEPARTURE 2 // the virtual bus's smallest finish tag is reached
+#define EVENT_GPS_START 4 // the earliest waiting packet's start tag is reached, it joins the virtual bus
+
+// what the caller hands to enqueue()
+typedef struct {
+    int flow; // caller chosen id >= 0, a flow is created with weight 1 the first time it is seen
+    int length;
+    double weight; // new weight for the flow from this packet on, NO_WEIGHT keeps the current one
+    unsigned long long cookie; // opaque to the scheduler, comes back in the WfqDeparture
+} WfqPacket;
+
+// what dequeue() hands back
+typedef struct {
+    long long start_time; // when the packet starts transmitting
+    long long arrival_time;
+    int flow;
+    int length;
+    unsigned long long cookie;
+} WfqDeparture;
+
+// packets live in packet_pool once they arrive and are linked into their flow's lists
+typedef struct {
+    long long arrival_time;
+    vtime_t virtual_start_time;
+    vtime_t virtual_finish_time;
+    double weight;
+    unsigned long long cookie;
+    int length;
+    int flow;
+    int appearance_order; // enqueue order, breaks ties between equal virtual times
+
+    int next_ready; // next packet of the flow waiting for the link, -1 = last
+    int next_gps; // next packet of the flow on / waiting for the virtual bus, -1 = last, SOLO_ON_BUS
+    int refs; // real queue + GPS emulation, back to the free list at 0
+} QueuedPacket;
+
+// what the heaps hold: one entry per flow that has packets in the matching list
+typedef struct {
+    vtime_t key; // VFT, or VST for wait_for_virtual_bus
+    int appearance_order;
+    int packet;
+} HeapEntry;
+
+typedef struct {
+    double weight;
+    vtime_t virtual_finish_time;
+
+    // per flow FIFOs of packet_pool indices, VFT (VST for wait) never goes down within a flow so
+    // only the head has to be in the global heap
+    int ready_head, ready_tail;
+    int bus_head, bus_tail;
+    int wait_head, wait_tail;
+
+    // DRR only
+    double deficit;
+    int drr_credited; // got its quantum for the current visit
+    int next_active; // next flow in the round, -1 = last
+
+    int parent_class; // HWFQ only
+} FlowState;
+
+struct CompareByKey {
+    bool operator()(const HeapEntry& a, const HeapEntry& b) const {
+#if FIXED_POINT_VTIME
+        if (a.key != b.key) return a.key > b.key;
+#else
+        double diff = a.key - b.key;
+
+        if (fabs(diff) > EPSILON) return a.key > b.key;
+#endif
+        return a.appearance_order > b.appearance_order;
+    }
+};
+
+// Calendar queue (Brown 1988) over the same entries, build with -DCALENDAR_QUEUE=1 to use it for
+// all three queues. Buckets are slots of `width` virtual time, amortised O(1) push/pop as long as
+// the width tracks the spacing of the keys, which resize() re-estimates whenever the size doubles
+// or halves. Pops follow the same rule as CompareByKey: smallest key, and among everything within
+// TIME_EPSILON of it the smallest appearance_order.
+#ifndef CALENDAR_QUEUE
+#define CALENDAR_QUEUE 0
+#endif
+#define CALENDAR_MIN_BUCKETS 16
+#define CALENDAR_MIN_WIDTH (FIXED_POINT_VTIME ? (vtime_t)1 : (vtime_t)(4 * EPSILON))
+
+struct CalendarQueue {
+    std::vector<std::vector<HeapEntry> > buckets;
+    size_t count;
+    vtime_t width;
+    long long cur_slot; // no entry has a slot below this
+    int has_top;
+    size_t top_bucket, top_pos;
+
+    CalendarQueue() : buckets(CALENDAR_MIN_BUCKETS), count(0), width(1.0), cur_slot(0), has_top(0), top_bucket(0), top_pos(0) {}
+
+    long long slot_of(vtime_t key) const { return (long long)(key / width); } // keys are >= 0
+    size_t bucket_of(long long slot) const { return (size_t)slot & (buckets.size() - 1); }
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    void push(const HeapEntry& entry);
+    const HeapEntry& top();
+    void pop();
+    void find_top();
+    void resize(size_t new_size);
+};
+
+// the standard heap with its array exposed, a checkpoint has to restore the exact layout because
+// CompareByKey's EPSILON makes the pop order depend on it
+struct EntryHeap : std::priority_queue<HeapEntry, std::vector<HeapEntry>, CompareByKey> {
+    std::vector<HeapEntry>& items() { return c; }
+    const std::vector<HeapEntry>& items() const { return c; }
+};
+
+#if CALENDAR_QUEUE
+typedef CalendarQueue EntryQueue;
+#else
+typedef EntryHeap EntryQueue;
+#endif
+
+// A class of hierarchical WFQ: WF2Q+ among its backlogged children (flows and classes) on its own
+// virtual clock. Like H-PFQ (Bennett & Zhang 1997) each class holds one head packet, picked from
+// its children when the previous one has been sent, and competes in its parent with that packet.
+struct ClassNode {
+    int parent; // -1 for the root
+    double weight;
+    vtime_t virtual_time;
+    weight_t sum_backlogged_weight;
+    int head; // packet this class sends next, -1 = nothing backlogged below it
+    int chosen; // child head came from, out of the heaps until its packet has been sent
+    vtime_t virtual_start_time; // of head, in the parent's virtual time
+    vtime_t virtual_finish_time;
+    EntryQueue eligible; // children by finish tag
+    EntryQueue ineligible; // children by start tag, not due yet
+};
+
+class WfqScheduler {
+public:
+    WfqScheduler();
+
+    // one of the DISCIPLINE_ values, before the first enqueue
+    void set_discipline(int discipline) { this->discipline = discipline; }
+    // DISCIPLINE_HWFQ: a new class under parent (ROOT_CLASS or an earlier id), returns its id
+    int add_class(int parent, double weight);
+    // DISCIPLINE_HWFQ: flows start under ROOT_CLASS, move them before their first packet
+    void set_flow_class(int flow, int class_id) { flow_state(flow)->parent_class = class_id; }
+    // the flow holds no packets and its finish tag is not ahead of its virtual clock, so it would tag
+    // its next packet exactly like a new flow
+    int flow_idle(int flow) const;
+    // an idle flow starts over as a new one (weight 1, under ROOT_CLASS) so that its id can go to
+    // another flow, returns the weight it had
+    double reset_flow(int flow);
+
+    // packet arrives at now, every arrival up to now goes in before dequeue(now) is called
+    void enqueue(const WfqPacket& packet, long long now);
+    // the next packet that starts transmitting at or before now, 0 if there is none. now is
+    // LLONG_MAX to drain everything once there will be no more arrivals.
+    int dequeue(long long now, WfqDeparture* departure);
+    // when the next packet starts transmitting if nothing else arrives, LLONG_MAX if idle
+    long long next_event_time() const;
+    // packets that have not started transmitting yet
+    size_t backlog() const { return queued; }
+
+    // Checkpoints: save() appends the whole state to out, load() replaces the state with one that
+    // save() wrote in a build with the same options and returns 0 (changing nothing) if it cannot.
+    // A restored scheduler carries on exactly like the saved one. The trace ring is not saved.
+    void save(std::vector<char>* out) const;
+    int load(const char* data, size_t size);
+    // cookies of the packets dequeue() has not handed out yet
+    void held_cookies(std::vector<unsigned long long>* out) const;
+#if WFQ_TRACE
+    // the last events of this scheduler, for wfq_trace_write()
+    const WfqTraceRing* trace_ring() const { return &trace; }
+#endif
+
+private:
+    int discipline;
+    std::vector<FlowState> flows;
+    vtime_t virtual_time;
+    rtime_t next_departure_time; // Represents when the server becomes free next
+    EntryQueue ready_queue;
+    EntryQueue virtual_bus;
+    EntryQueue wait_for_virtual_bus;
+    EntryQueue ineligible_queue; // WF2Q+ flow heads by start tag, not yet due
+    int drr_head, drr_tail; // DRR round of backlogged flows
+    std::vector<ClassNode> classes;
+    int hier_in_service; // HWFQ: last packet sent, the classes above it move on when the link frees up
+    std::vector<QueuedPacket> packet_pool;
+    std::vector<int> free_packet_slots;
+    std::vector<WfqDeparture> departures; // decided, not handed out yet
+    size_t departures_head;
+    rtime_t last_virtual_change;
+    rtime_t current_time;
+    char is_packet_on_bus;
+    weight_t sum_active_weight; // GPS: weights on the virtual bus, WF2Q+: of the backlogged flows
+    int next_appearance_order;
+    int arrivals_open; // the last pass took arrivals and has not scheduled yet
+    size_t queued;
+#if WFQ_TRACE
+    WfqTraceRing trace;
+#endif
+
+    void advance(long long next_arrival_event_time);
+    int next_events(rtime_t horizon, rtime_t* when);
+    void run_events(int events, rtime_t when);
+    void progress_virtual_time();
+    void handle_packet_arrival(const WfqPacket& packet, long long now);
+    void schedule_next_packet();
+    FlowState* flow_state(int flow);
+    int store_packet(const QueuedPacket& packet);
+    void release_packet(int idx);
+    HeapEntry make_entry(vtime_t key, int idx) const;
+    int append_to_flow(int idx);
+    int pop_from_flow(int idx);
+    void enqueue_ready(int idx);
+    int dequeue_ready();
+    int pick_wf2qplus();
+    void push_wf2qplus_head(int idx);
+    int pick_drr();
+    int pick_hierarchical();
+    void activate_child(int class_id, int child, vtime_t start, vtime_t finish, weight_t weight);
+    void reset_path(int idx);
+    void push_child(ClassNode* node, int child, vtime_t start, vtime_t finish);
+    void select_child(ClassNode* node);
+    int child_head(int child) const;
+    void remove_from_virtual_bus();
+    void add_to_virtual_bus(int idx);
+    void add_to_wait_for_virtual_bus(int idx);
+    void move_to_virtual_bus();
+};
+
+#endif
@@ -0,0 +1,65 @@
+// Per-phase timing for the benchmark builds (-DWFQ_PROFILE=1), shared by both engines.
+// With profiling off every macro expands to nothing.
+// At exit one line goes to stderr, wfq_bench parses it:
+//   wfq-profile packets=N total_ns=.. parse_ns=.. schedule_ns=.. output_ns=.. maxrss_kb=..
+// schedule_ns is whatever is left of the run after parsing and output. The counters are atomic:
+// with several threads (-p, -T, -P, -B) parse_ns and output_ns add up every thread's time, so they
+// are CPU time and can exceed total_ns, schedule_ns then is not meaningful.
+#ifndef WFQ_PROFILE_H
+#define WFQ_PROFILE_H
+
+#ifndef WFQ_PROFILE
+#define WFQ_PROFILE 0
+#endif
+
+#if WFQ_PROFILE
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L // clock_gettime under -std=c11, include this header first
+#endif
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#ifdef __cplusplus
+#include <atomic>
+typedef std::atomic<long long> profile_counter;
+#else
+#include <stdatomic.h>
+typedef _Atomic long long profile_counter;
+#endif
+
+// zero initialized, they have static storage
+static long long profile_start_ns = 0;
+static profile_counter profile_parse_ns;
+static profile_counter profile_output_ns;
+static profile_counter profile_packets;
+
+static long long profile_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void profile_report(void) {
+    long long total = profile_now_ns() - profile_start_ns;
+    long long packets = profile_packets, parse = profile_parse_ns, output = profile_output_ns;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "wfq-profile packets=%lld total_ns=%lld parse_ns=%lld schedule_ns=%lld output_ns=%lld maxrss_kb=%ld\n",
+            packets, total, parse, total - parse - output, output, (long)usage.ru_maxrss);
+}
+
+#define PROFILE_START() (profile_start_ns = profile_now_ns())
+#define PROFILE_BEGIN() long long profile_t0 = profile_now_ns()
+#define PROFILE_END(counter) ((counter) += profile_now_ns() - profile_t0)
+#define PROFILE_COUNT_PACKET() (profile_packets++)
+#define PROFILE_REPORT() profile_report()
+#else
+#define PROFILE_START()
+#define PROFILE_BEGIN()
+#define PROFILE_END(counter)
+#define PROFILE_COUNT_PACKET()
+#define PROFILE_REPORT()
+#endif
+
+#endif
@@ -1,18 +1,23 @@
+#include "wfq_profile.h" // first, it may set _POSIX_C_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <float.h>
 #include <math.h>   // fabs
+#include <limits.h> // LLONG_MAX
 #define MAX_IP_LEN 16
 #define MAX_LINE_LEN 256
-#define MAX_CONNECTIONS 10000
+#define INITIAL_CONNECTION_CAPACITY 1024
 #define INITIAL_PACKET_CAPACITY 100000
+#define INITIAL_HEAP_CAPACITY 1024
+#define WEIGHT_UNIT_BITS 20 // weights that are multiples of 2^-20 add up exactly as integers
 
+// packed 4-tuple, ips in host byte order
 typedef struct {
-    char src_ip[MAX_IP_LEN];
-    int src_port;
-    char dst_ip[MAX_IP_LEN];
-    int dst_port;
+    unsigned int src_ip;
+    unsigned int dst_ip;
+    unsigned short src_port;
+    unsigned short dst_port;
 } Connection;
 
 typedef struct {
@@ -31,7 +36,12 @@ typedef struct {
     double virtual_finish_time;
     int connection_id;
     int appearance_order;
-    char is_on_bus;
+    char is_on_bus; // set once sent, the packet has left the ready queue
+
+    // links between packets, all by index in pending_packets
+    int bus_next; // next packet of the connection on the virtual bus
+    int ready_prev, ready_next; // ready packets with the same VFT, in arrival order
+    int vft_group;
 } Packet;
 
 typedef struct {
@@ -40,6 +50,7 @@ typedef struct {
     double virtual_finish_time;
     int appearance_order;
     int active;
+    int bus_head, bus_tail; // its packets on the virtual bus by VFT, -1 if none
 } ConnectionInfo;
 
 typedef struct {
@@ -48,15 +59,52 @@ typedef struct {
     int capacity;
 } PacketQueue;
 
+// binary min-heap of ints, moved() (if set) is told every item's new index so that items can be
+// removed from the middle
+typedef struct {
+    int* items;
+    int count;
+    int capacity;
+    int (*before)(int a, int b);
+    void (*moved)(int item, int index);
+} IndexHeap;
+
+// the ready packets that share one VFT, dropped (and its id reused) once the last one is sent
+typedef struct {
+    double virtual_finish_time;
+    int first, last;
+    int heap_pos; // in ready_groups, -1 while free
+} VftGroup;
+
 // Global state
-ConnectionInfo connections[MAX_CONNECTIONS];
+ConnectionInfo* connections = NULL;
 int num_connections = 0;
+int connections_capacity = 0;
+int* conn_table = NULL; // open addressing, holds connection ids, -1 = empty slot
+unsigned int conn_table_mask = 0;
 double virtual_time = 0.0;
 double next_departure_time = 0; // Represents when the server becomes free next
-PacketQueue pending_packets = {NULL, 0, 0};
-PacketQueue ready_queue = {NULL, 0, 0};
-PacketQueue virtual_bus = {NULL, 0, 0};
-// PacketQueue to_leave_virtual_bus = {NULL, 0, 0};
+PacketQueue pending_packets = {NULL, 0, 0}; // every packet, sorted by arrival, the heaps hold indices into it
+int pending_head = 0; // next packet to arrive
+// Ready queue: the heap holds one group per distinct VFT. Packets before ready_first have been sent.
+IndexHeap ready_groups;
+int ready_count = 0;
+int ready_first = 0;
+VftGroup* vft_groups = NULL;
+int num_vft_groups = 0; // ids handed out, free ones included
+int vft_groups_capacity = 0;
+int* free_vft_groups = NULL; // ids to reuse, vft_groups_capacity of room
+int num_free_vft_groups = 0;
+int* vft_table = NULL; // open addressing VFT -> group, -1 = empty slot
+unsigned int vft_table_mask = 0;
+// virtual bus ordered by VFT and appearance order
+IndexHeap virtual_bus;
+long long active_weight_units = 0; // weights of the connections on the bus, in 2^-WEIGHT_UNIT_BITS
+int inexact_active_weights = 0; // those of them that are not a multiple of 2^-WEIGHT_UNIT_BITS
+double ordered_weight_sum = 0.0; // the last sum taken in VFT order, until a bus head changes
+int ordered_weight_sum_stale = 1;
+int* active_scratch = NULL;
+int active_scratch_capacity = 0;
 double last_virtual_change = 0.0;
 double current_time = 0.0;
 char is_packet_on_bus = 0;
@@ -69,12 +117,32 @@ int debug_arrival_time_1 = 969231;
 
 // Function prototypes
 int find_or_create_connection(const char* src_ip, int src_port, const char* dst_ip, int dst_port, int appearance_order);
+unsigned int pack_ipv4(const char* ip);
+unsigned int hash_connection(const Connection* c);
+void grow_conn_table();
 void parse_packet(const char* line, Packet* packet, int appearance_order);
 void add_packet_to_queue(PacketQueue* queue, const Packet* packet);
-void remove_packet_from_queue(PacketQueue* queue, int index);
 int compare_packets_by_arrival_time(const void* a, const void* b);
 void schedule_next_packet();
 void init_packet_queue(PacketQueue* queue);
+void heap_init(IndexHeap* heap, int (*before)(int, int), void (*moved)(int, int));
+void heap_push(IndexHeap* heap, int item);
+void heap_remove(IndexHeap* heap, int index);
+void heap_sift_up(IndexHeap* heap, int index);
+void heap_sift_down(IndexHeap* heap, int index);
+int bus_before(int a, int b);
+int vft_group_before(int a, int b);
+void vft_group_moved(int group, int index);
+int compare_bus_heads(const void* a, const void* b);
+void add_to_virtual_bus(int p);
+void remove_first_from_virtual_bus();
+void change_active_weight(double weight, int sign);
+int find_or_create_vft_group(double vft);
+void drop_vft_group(int g);
+void grow_vft_table();
+void add_to_ready(int p);
+void remove_from_ready(int p);
+int pick_ready_packet();
 void cleanup();
 char* my_strdup(const char* s);
 double sum_Active_weights();
@@ -92,26 +160,44 @@ int find_packet_by_appearance(PacketQueue *queue, int appearance_order) {
 
 
 
+// the weight of the first packet of every connection on the virtual bus, summed in VFT order.
+// Kept up to date as an integer while every such weight is a multiple of 2^-WEIGHT_UNIT_BITS, then
+// the order makes no difference. Otherwise the heads are sorted and summed in order, the rounding
+// has to be the same. That sum is kept until a head changes, it is asked for twice per event.
 double sum_Active_weights() {
-    int num_active_ids = 0;
-    int active_conn_ids[MAX_CONNECTIONS] = {0};
+    if (inexact_active_weights == 0 && active_weight_units < (1LL << 53)) {
+        return (double)active_weight_units / (1 << WEIGHT_UNIT_BITS);
+    }
+    if (!ordered_weight_sum_stale) return ordered_weight_sum;
+    if (active_scratch_capacity < num_connections) {
+        active_scratch_capacity = connections_capacity;
+        active_scratch = realloc(active_scratch, active_scratch_capacity * sizeof(int));
+    }
+    int num_active = 0;
+    for (int i = 0; i < num_connections; i++) {
+        if (connections[i].bus_head != -1) active_scratch[num_active++] = connections[i].bus_head;
+    }
+    qsort(active_scratch, num_active, sizeof(int), compare_bus_heads);
     double current_weight_sum = 0;
-    for (int i = 0 ; i < virtual_bus.count; i++) {
-        int conn_id = virtual_bus.packets[i].connection_id;
-        int found = 0;
-        for(int k=0; k < num_active_ids; ++k) {
-            if(active_conn_ids[k] == conn_id) {
-                found = 1;
-                break;
-            }
-        }
-        if(!found) {
-                current_weight_sum += virtual_bus.packets[i].weight;
-                active_conn_ids[num_active_ids++] = conn_id;
-        }
+    for (int i = 0; i < num_active; i++) {
+        current_weight_sum += pending_packets.packets[active_scratch[i]].weight;
     }
+    ordered_weight_sum = current_weight_sum;
+    ordered_weight_sum_stale = 0;
     return current_weight_sum;
 }
+
+// every change of a connection's head on the bus comes through here
+void change_active_weight(double weight, int sign) {
+    double units = weight * (1 << WEIGHT_UNIT_BITS); // exact, a power of two
+    if (weight > 0 && units < (double)(1LL << 40) && units == (double)(long long)units) {
+        active_weight_units += sign * (long long)units;
+    } else {
+        inexact_active_weights += sign;
+    }
+    ordered_weight_sum_stale = 1;
+}
+
 char* my_strdup(const char* s) {
     size_t len = strlen(s) + 1;
     char* copy = malloc(len);
@@ -130,20 +216,25 @@ int compare_packets_by_arrival_time(const void* a, const void* b) {
     return pa->appearance_order - pb->appearance_order;
 }
 
-int compare_packets_by_virtual_finish_time(const void* a, const void* b) {
-    const Packet* pa = (const Packet*)a;
-    const Packet* pb = (const Packet*)b;
-    if (pa->virtual_finish_time < pb->virtual_finish_time) return -1;
-    if (pa->virtual_finish_time > pb->virtual_finish_time) return 1;
-    return pa->appearance_order - pb->appearance_order;
+// virtual bus order
+int bus_before(int a, int b) {
+    const Packet* pa = &pending_packets.packets[a];
+    const Packet* pb = &pending_packets.packets[b];
+    if (pa->virtual_finish_time != pb->virtual_finish_time) return pa->virtual_finish_time < pb->virtual_finish_time;
+    return pa->appearance_order < pb->appearance_order;
+}
+
+int compare_bus_heads(const void* a, const void* b) {
+    return bus_before(*(const int*)a, *(const int*)b) ? -1 : 1; // heads are distinct packets
 }
 int main() {
     char line[MAX_LINE_LEN];
     int appearance_order = 0;
     init_packet_queue(&pending_packets);
-    init_packet_queue(&ready_queue);
-    init_packet_queue(&virtual_bus);
-    // init_packet_queue(&to_leave_virtual_bus);
+    heap_init(&ready_groups, vft_group_before, vft_group_moved);
+    heap_init(&virtual_bus, bus_before, NULL);
+    PROFILE_START();
+    PROFILE_BEGIN();
     while (fgets(line, sizeof(line), stdin)) {
         line[strcspn(line, "\n")] = 0;
         if (strlen(line) == 0) continue;
@@ -153,11 +244,12 @@ int main() {
     }
 
     qsort(pending_packets.packets, pending_packets.count, sizeof(Packet), compare_packets_by_arrival_time);
+    PROFILE_END(profile_parse_ns);
 
-    while (pending_packets.count > 0 || ready_queue.count > 0) {
-        long long next_arrival_event_time = (pending_packets.count > 0) ? pending_packets.packets[0].arrival_time : LLONG_MAX;
+    while (pending_head < pending_packets.count || ready_count > 0) {
+        long long next_arrival_event_time = (pending_head < pending_packets.count) ? pending_packets.packets[pending_head].arrival_time : LLONG_MAX;
 
-        if (ready_queue.count == 0 && next_arrival_event_time == LLONG_MAX) {
+        if (ready_count == 0 && next_arrival_event_time == LLONG_MAX) {
             break;
         }
         current_time = next_arrival_event_time;
@@ -165,7 +257,7 @@ int main() {
             current_time = next_departure_time;
         }
             if (virtual_bus.count != 0) {
-                double virtual_finish = virtual_bus.packets[0].virtual_finish_time;
+                double virtual_finish = pending_packets.packets[virtual_bus.items[0]].virtual_finish_time;
                 if ((current_time <= debug_arrival_time_1 && current_time >= debug_arrival_time_2) && Debug == 1) {
                     printf("reason for call: compute if next event is virtual departure \n\n");
                 }
@@ -198,50 +290,49 @@ int main() {
         // }
         if (should_remove_from_virtual_bus) {
             should_remove_from_virtual_bus = 0;
-            remove_packet_from_queue(&virtual_bus, 0);
+            remove_first_from_virtual_bus();
         }
 
         if (current_time >= next_departure_time && is_packet_on_bus ==  1) {
             is_packet_on_bus = 0;
         }
         // Process all packets that have arrived by this current_time
-        if (pending_packets.count > 0 && pending_packets.packets[0].arrival_time <= current_time) {
-            Packet packet = pending_packets.packets[0];
+        if (pending_head < pending_packets.count && pending_packets.packets[pending_head].arrival_time <= current_time) {
+            int arriving = pending_head++;
+            Packet* packet = &pending_packets.packets[arriving];
             // Find or create connection
-            packet.connection_id = find_or_create_connection(packet.src_ip, packet.src_port,
-                                                             packet.dst_ip, packet.dst_port,
-                                                             appearance_order);
-            remove_packet_from_queue(&pending_packets, 0);
+            packet->connection_id = find_or_create_connection(packet->src_ip, packet->src_port,
+                                                              packet->dst_ip, packet->dst_port,
+                                                              appearance_order);
 
-            int conn_id = packet.connection_id;
+            int conn_id = packet->connection_id;
             double last_conn_vft = connections[conn_id].virtual_finish_time;
 
             double virtual_start = (virtual_time > last_conn_vft) ? virtual_time : last_conn_vft;
 
 
-             if ((packet.arrival_time <= debug_arrival_time_1  && packet.arrival_time >=  debug_arrival_time_2) && Debug == 1) {
-                printf("DEBUG: %s virtual start: %f lastconfft %f virtual time %f \n", packet.original_line, virtual_start, last_conn_vft, virtual_time);
+             if ((packet->arrival_time <= debug_arrival_time_1  && packet->arrival_time >=  debug_arrival_time_2) && Debug == 1) {
+                printf("DEBUG: %s virtual start: %f lastconfft %f virtual time %f \n", packet->original_line, virtual_start, last_conn_vft, virtual_time);
              }
 
 
-            packet.virtual_start_time = virtual_start;
-            if (packet.has_weight) {
-                connections[conn_id].weight = packet.weight;
-            }else{packet.weight = connections[conn_id].weight;} //if packet does not have a specified weight, take the connection's at the time
-            packet.virtual_finish_time = virtual_start + (double)packet.length / connections[conn_id].weight;
+            packet->virtual_start_time = virtual_start;
+            if (packet->has_weight) {
+                connections[conn_id].weight = packet->weight;
+            }else{packet->weight = connections[conn_id].weight;} //if packet does not have a specified weight, take the connection's at the time
+            packet->virtual_finish_time = virtual_start + (double)packet->length / connections[conn_id].weight;
 
-            if ((packet.arrival_time <= debug_arrival_time_1  && packet.arrival_time >=  debug_arrival_time_2) && Debug == 1) {
-                printf("DEBUG: %s Virtual End %f length %d weight %lf \n", packet.original_line, packet.virtual_finish_time, packet.length, connections[packet.connection_id].weight);
+            if ((packet->arrival_time <= debug_arrival_time_1  && packet->arrival_time >=  debug_arrival_time_2) && Debug == 1) {
+                printf("DEBUG: %s Virtual End %f length %d weight %lf \n", packet->original_line, packet->virtual_finish_time, packet->length, connections[packet->connection_id].weight);
             }
-            connections[conn_id].virtual_finish_time = packet.virtual_finish_time;
+            connections[conn_id].virtual_finish_time = packet->virtual_finish_time;
 
-            add_packet_to_queue(&ready_queue, &packet);
-            add_packet_to_queue(&virtual_bus, &packet);
-            qsort(virtual_bus.packets, virtual_bus.count, sizeof(Packet), compare_packets_by_virtual_finish_time);
+            add_to_ready(arriving);
+            add_to_virtual_bus(arriving);
         }
 
 
-        if (ready_queue.count > 0 && next_departure_time <= current_time && is_packet_on_bus == 0){// && is_packet_on_bus == 0) { //was && real_time <= current_time
+        if (ready_count > 0 && next_departure_time <= current_time && is_packet_on_bus == 0){// && is_packet_on_bus == 0) { //was && real_time <= current_time
             schedule_next_packet(current_time);
         }
 
@@ -250,6 +341,7 @@ int main() {
     }
 
     cleanup();
+    PROFILE_REPORT();
     return 0;
 }
 
@@ -259,32 +351,79 @@ void init_packet_queue(PacketQueue* queue) {
     queue->count = 0;
 }
 
+unsigned int pack_ipv4(const char* ip) {
+    unsigned int addr = 0, octet = 0;
+    for (; *ip; ip++) {
+        if (*ip == '.') {
+            addr = (addr << 8) | (octet & 0xff);
+            octet = 0;
+        } else {
+            octet = octet * 10 + (unsigned int)(*ip - '0');
+        }
+    }
+    return (addr << 8) | (octet & 0xff);
+}
+
+unsigned int hash_connection(const Connection* c) {
+    unsigned long long h = ((unsigned long long)c->src_ip << 32) | c->dst_ip;
+    h ^= ((unsigned long long)c->src_port << 16 | c->dst_port) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned int)h;
+}
+
+// doubles the hash table and reinserts every connection, keeps load factor <= 1/2
+void grow_conn_table() {
+    unsigned int new_size = conn_table ? (conn_table_mask + 1) * 2 : INITIAL_CONNECTION_CAPACITY * 2;
+    free(conn_table);
+    conn_table = malloc(new_size * sizeof(int));
+    memset(conn_table, 0xff, new_size * sizeof(int));
+    conn_table_mask = new_size - 1;
+    for (int i = 0; i < num_connections; i++) {
+        unsigned int slot = hash_connection(&connections[i].conn) & conn_table_mask;
+        while (conn_table[slot] != -1) slot = (slot + 1) & conn_table_mask;
+        conn_table[slot] = i;
+    }
+}
+
 int find_or_create_connection(const char* src_ip, int src_port, const char* dst_ip, int dst_port, int appearance_order) {
+    Connection key;
+    key.src_ip = pack_ipv4(src_ip);
+    key.dst_ip = pack_ipv4(dst_ip);
+    key.src_port = (unsigned short)src_port;
+    key.dst_port = (unsigned short)dst_port;
+
+    if ((unsigned int)(num_connections + 1) * 2 > conn_table_mask + 1) {
+        grow_conn_table();
+    }
+
     // Look for existing connection
-    for (int i = 0; i < num_connections; i++) {
-        if (strcmp(connections[i].conn.src_ip, src_ip) == 0 &&
-            connections[i].conn.src_port == src_port &&
-            strcmp(connections[i].conn.dst_ip, dst_ip) == 0 &&
-            connections[i].conn.dst_port == dst_port) {
-            return i;
+    unsigned int slot = hash_connection(&key) & conn_table_mask;
+    while (conn_table[slot] != -1) {
+        const Connection* c = &connections[conn_table[slot]].conn;
+        if (c->src_ip == key.src_ip && c->dst_ip == key.dst_ip &&
+            c->src_port == key.src_port && c->dst_port == key.dst_port) {
+            return conn_table[slot];
         }
+        slot = (slot + 1) & conn_table_mask;
     }
 
     // Create new connection
-    if (num_connections >= MAX_CONNECTIONS) {
-        fprintf(stderr, "Too many connections\n");
-        exit(1);
+    if (num_connections >= connections_capacity) {
+        connections_capacity = connections_capacity ? connections_capacity * 2 : INITIAL_CONNECTION_CAPACITY;
+        connections = realloc(connections, connections_capacity * sizeof(ConnectionInfo));
     }
 
     int id = num_connections++;
-    strcpy(connections[id].conn.src_ip, src_ip);
-    connections[id].conn.src_port = src_port;
-    strcpy(connections[id].conn.dst_ip, dst_ip);
-    connections[id].conn.dst_port = dst_port;
+    conn_table[slot] = id;
+    connections[id].conn = key;
     connections[id].weight = 1; // Default weight - THIS MUST BE 1
     connections[id].virtual_finish_time = 0.0;
     connections[id].appearance_order = appearance_order;
     connections[id].active = 0;
+    connections[id].bus_head = -1;
+    connections[id].bus_tail = -1;
 
     return id;
 }
@@ -330,39 +469,268 @@ void add_packet_to_queue(PacketQueue* queue, const Packet* packet) {
     queue->packets[queue->count++] = *packet;
 }
 
-void remove_packet_from_queue(PacketQueue* queue, int index) {
+void heap_init(IndexHeap* heap, int (*before)(int, int), void (*moved)(int, int)) {
+    heap->capacity = INITIAL_HEAP_CAPACITY;
+    heap->items = malloc(heap->capacity * sizeof(int));
+    heap->count = 0;
+    heap->before = before;
+    heap->moved = moved;
+}
 
-    for (int i = index; i < queue->count - 1; i++) {
-        queue->packets[i] = queue->packets[i + 1];
+void heap_sift_up(IndexHeap* heap, int index) {
+    int item = heap->items[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!heap->before(item, heap->items[parent])) break;
+        heap->items[index] = heap->items[parent];
+        if (heap->moved) heap->moved(heap->items[index], index);
+        index = parent;
     }
-    queue->count--;
+    heap->items[index] = item;
+    if (heap->moved) heap->moved(item, index);
 }
 
-void schedule_next_packet() {
-    if (ready_queue.count == 0) return;
+void heap_sift_down(IndexHeap* heap, int index) {
+    int item = heap->items[index];
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count && heap->before(heap->items[child + 1], heap->items[child])) child++;
+        if (!heap->before(heap->items[child], item)) break;
+        heap->items[index] = heap->items[child];
+        if (heap->moved) heap->moved(heap->items[index], index);
+        index = child;
+    }
+    heap->items[index] = item;
+    if (heap->moved) heap->moved(item, index);
+}
 
+void heap_push(IndexHeap* heap, int item) {
+    if (heap->count >= heap->capacity) {
+        heap->capacity *= 2;
+        heap->items = realloc(heap->items, heap->capacity * sizeof(int));
+    }
+    heap->items[heap->count++] = item;
+    heap_sift_up(heap, heap->count - 1);
+}
+
+void heap_remove(IndexHeap* heap, int index) {
+    heap->count--;
+    if (index == heap->count) return;
+    heap->items[index] = heap->items[heap->count];
+    heap_sift_up(heap, index);
+    heap_sift_down(heap, index);
+}
+
+// The bus is a heap, the connection's own packets on it a list in the same order. Packets of a
+// connection arrive with non-decreasing VFTs, so a new one goes last unless it ties.
+void add_to_virtual_bus(int p) {
+    heap_push(&virtual_bus, p);
+    Packet* packet = &pending_packets.packets[p];
+    ConnectionInfo* conn = &connections[packet->connection_id];
+    if (conn->bus_head == -1 || !bus_before(p, conn->bus_tail)) {
+        packet->bus_next = -1;
+        if (conn->bus_head == -1) {
+            conn->bus_head = p;
+            change_active_weight(packet->weight, 1);
+        } else {
+            pending_packets.packets[conn->bus_tail].bus_next = p;
+        }
+        conn->bus_tail = p;
+        return;
+    }
+    int prev = -1, next = conn->bus_head;
+    while (!bus_before(p, next)) {
+        prev = next;
+        next = pending_packets.packets[next].bus_next;
+    }
+    packet->bus_next = next;
+    if (prev != -1) {
+        pending_packets.packets[prev].bus_next = p;
+        return;
+    }
+    change_active_weight(pending_packets.packets[conn->bus_head].weight, -1);
+    change_active_weight(packet->weight, 1);
+    conn->bus_head = p;
+}
+
+// the first packet on the bus is also the first of its connection
+void remove_first_from_virtual_bus() {
+    int p = virtual_bus.items[0];
+    heap_remove(&virtual_bus, 0);
+    Packet* packet = &pending_packets.packets[p];
+    ConnectionInfo* conn = &connections[packet->connection_id];
+    change_active_weight(packet->weight, -1);
+    conn->bus_head = packet->bus_next;
+    if (conn->bus_head == -1) {
+        conn->bus_tail = -1;
+    } else {
+        change_active_weight(pending_packets.packets[conn->bus_head].weight, 1);
+    }
+}
+
+int vft_group_before(int a, int b) {
+    return vft_groups[a].virtual_finish_time < vft_groups[b].virtual_finish_time;
+}
+
+void vft_group_moved(int group, int index) {
+    vft_groups[group].heap_pos = index;
+}
+
+unsigned int hash_vft(double vft) {
+    unsigned long long h;
+    memcpy(&h, &vft, sizeof(h));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned int)h;
+}
+
+// doubles the VFT table like grow_conn_table()
+void grow_vft_table() {
+    unsigned int new_size = vft_table ? (vft_table_mask + 1) * 2 : INITIAL_HEAP_CAPACITY * 2;
+    free(vft_table);
+    vft_table = malloc(new_size * sizeof(int));
+    memset(vft_table, 0xff, new_size * sizeof(int));
+    vft_table_mask = new_size - 1;
+    for (int i = 0; i < num_vft_groups; i++) {
+        if (vft_groups[i].heap_pos == -1) continue;
+        unsigned int slot = hash_vft(vft_groups[i].virtual_finish_time) & vft_table_mask;
+        while (vft_table[slot] != -1) slot = (slot + 1) & vft_table_mask;
+        vft_table[slot] = i;
+    }
+}
+
+// the table only holds groups with ready packets, a group is made when the first comes
+int find_or_create_vft_group(double vft) {
+    if (vft == 0) vft = 0; // -0.0 and 0.0 are one group
+    if ((unsigned int)(num_vft_groups - num_free_vft_groups + 1) * 2 > vft_table_mask + 1) {
+        grow_vft_table();
+    }
+    unsigned int slot = hash_vft(vft) & vft_table_mask;
+    while (vft_table[slot] != -1) {
+        if (vft_groups[vft_table[slot]].virtual_finish_time == vft) return vft_table[slot];
+        slot = (slot + 1) & vft_table_mask;
+    }
+    int id;
+    if (num_free_vft_groups > 0) {
+        id = free_vft_groups[--num_free_vft_groups];
+    } else {
+        if (num_vft_groups >= vft_groups_capacity) {
+            vft_groups_capacity = vft_groups_capacity ? vft_groups_capacity * 2 : INITIAL_HEAP_CAPACITY;
+            vft_groups = realloc(vft_groups, vft_groups_capacity * sizeof(VftGroup));
+            free_vft_groups = realloc(free_vft_groups, vft_groups_capacity * sizeof(int));
+        }
+        id = num_vft_groups++;
+    }
+    vft_table[slot] = id;
+    vft_groups[id].virtual_finish_time = vft;
+    vft_groups[id].first = -1;
+    vft_groups[id].last = -1;
+    vft_groups[id].heap_pos = -1;
+    return id;
+}
+
+// takes an empty group out of the table by backward shift deletion, every probe sequence stays
+// unbroken, and frees its id
+void drop_vft_group(int g) {
+    unsigned int slot = hash_vft(vft_groups[g].virtual_finish_time) & vft_table_mask;
+    while (vft_table[slot] != g) slot = (slot + 1) & vft_table_mask;
+    unsigned int hole = slot;
+    while (vft_table[slot = (slot + 1) & vft_table_mask] != -1) {
+        int other = vft_table[slot];
+        unsigned int home = hash_vft(vft_groups[other].virtual_finish_time) & vft_table_mask;
+        if (((slot - home) & vft_table_mask) >= ((slot - hole) & vft_table_mask)) {
+            vft_table[hole] = other;
+            hole = slot;
+        }
+    }
+    vft_table[hole] = -1;
+    free_vft_groups[num_free_vft_groups++] = g;
+}
+
+void add_to_ready(int p) {
+    Packet* packet = &pending_packets.packets[p];
+    int g = find_or_create_vft_group(packet->virtual_finish_time);
+    VftGroup* group = &vft_groups[g];
+    packet->vft_group = g;
+    packet->ready_prev = group->last;
+    packet->ready_next = -1;
+    if (group->last != -1) {
+        pending_packets.packets[group->last].ready_next = p;
+    } else {
+        group->first = p;
+    }
+    group->last = p;
+    if (group->heap_pos == -1) heap_push(&ready_groups, g);
+    ready_count++;
+}
+
+void remove_from_ready(int p) {
+    Packet* packet = &pending_packets.packets[p];
+    VftGroup* group = &vft_groups[packet->vft_group];
+    if (packet->ready_prev != -1) {
+        pending_packets.packets[packet->ready_prev].ready_next = packet->ready_next;
+    } else {
+        group->first = packet->ready_next;
+    }
+    if (packet->ready_next != -1) {
+        pending_packets.packets[packet->ready_next].ready_prev = packet->ready_prev;
+    } else {
+        group->last = packet->ready_prev;
+    }
+    if (group->first == -1) {
+        heap_remove(&ready_groups, group->heap_pos);
+        group->heap_pos = -1;
+        drop_vft_group(packet->vft_group);
+    }
+    packet->is_on_bus = 1;
+    ready_count--;
+    while (ready_first < pending_head && pending_packets.packets[ready_first].is_on_bus) ready_first++;
+}
+
+// Picks like a scan of the ready packets in arrival order that moves on to a packet only if its
+// VFT is smaller by more than EPS. When no two VFTs are within EPS of each other without being
+// equal, that is the first packet with the smallest VFT (the connections' appearance orders used
+// to break near ties are all the same). Otherwise the scan is done.
+int pick_ready_packet() {
     const double EPS = 1e-9;   // tolerance for almost-equal VFTs
 
-    int best_idx = 0;
-    for (int i = 1; i < ready_queue.count; i++) {
-        if(ready_queue.packets[i].is_on_bus == 0) {
-            double diff = ready_queue.packets[i].virtual_finish_time -
-                          ready_queue.packets[best_idx].virtual_finish_time;
-
-            if (diff < -EPS ||                            /* clearly smaller VFT          */
-                (fabs(diff) <= EPS &&                   /* virtually equal → tie-break  */
-                 connections[ready_queue.packets[i].connection_id].appearance_order <
-                 connections[ready_queue.packets[best_idx].connection_id].appearance_order)) {
-                best_idx = i;
-                 }
+    int first = ready_groups.items[0];
+    double smallest = vft_groups[first].virtual_finish_time;
+    int near_tie = 0;
+    for (int i = 1; i <= 2 && i < ready_groups.count; i++) {
+        near_tie |= !(smallest - vft_groups[ready_groups.items[i]].virtual_finish_time < -EPS);
+    }
+    if (!near_tie) return vft_groups[first].first;
+
+    int best_idx = -1;
+    for (int i = ready_first; i < pending_head; i++) {
+        if (pending_packets.packets[i].is_on_bus) continue;
+        if (best_idx == -1) {
+            best_idx = i;
+            continue;
+        }
+        double diff = pending_packets.packets[i].virtual_finish_time -
+                      pending_packets.packets[best_idx].virtual_finish_time;
+
+        if (diff < -EPS ||                            /* clearly smaller VFT          */
+            (fabs(diff) <= EPS &&                   /* virtually equal → tie-break  */
+             connections[pending_packets.packets[i].connection_id].appearance_order <
+             connections[pending_packets.packets[best_idx].connection_id].appearance_order)) {
+            best_idx = i;
         }
     }
-        ready_queue.packets[best_idx].is_on_bus = 1;
-        Packet packet_to_send = ready_queue.packets[best_idx];
-    //remove_packet_from_queue(&ready_queue, best_idx);
+    return best_idx;
+}
+
+void schedule_next_packet() {
+    if (ready_count == 0) return;
+
+    int best_idx = pick_ready_packet();
+        remove_from_ready(best_idx);
+        Packet packet_to_send = pending_packets.packets[best_idx];
         is_packet_on_bus = 1;
-        //packet_on_bus_idx = best_idx;
-        remove_packet_from_queue(&ready_queue, best_idx);
     if ((current_time <= debug_arrival_time_1 && current_time >= debug_arrival_time_2) && Debug == 1) {
         printf("new packet on bus at time %lf, %s\n", current_time, packet_to_send.original_line);
     }
@@ -373,7 +741,10 @@ void schedule_next_packet() {
     long long actual_start_time = (next_departure_time > packet_to_send.arrival_time) ? next_departure_time : packet_to_send.arrival_time;
 
     // Original output format restored
+    PROFILE_BEGIN();
+    PROFILE_COUNT_PACKET();
     printf("%lld: %s\n", actual_start_time, packet_to_send.original_line);
+    PROFILE_END(profile_output_ns);
 
 
 
@@ -388,6 +759,12 @@ void schedule_next_packet() {
 
 void cleanup() {
     if (pending_packets.packets) free(pending_packets.packets);
-    if (ready_queue.packets) free(ready_queue.packets);
-    if (virtual_bus.packets) free(virtual_bus.packets);
+    free(ready_groups.items);
+    free(virtual_bus.items);
+    free(vft_groups);
+    free(free_vft_groups);
+    free(vft_table);
+    free(active_scratch);
+    free(connections);
+    free(conn_table);
 }
\ No newline at end of file
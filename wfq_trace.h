@@ -0,0 +1,98 @@
+// Event tracing for the scheduling core, build with -DWFQ_TRACE=1 to turn it on. With tracing off
+// WFQ_TRACE_EVENT expands to nothing and its arguments are never evaluated.
+// With it on, every WfqScheduler keeps the last 2^WFQ_TRACE_RING_BITS events in a ring of fixed
+// size WfqTraceEvent records, see WfqScheduler::trace_ring(). wfq_trace_write() dumps a ring to a
+// file that tools/wfq_trace_decode turns back into text.
+//
+// File layout (native byte order): WfqTraceHeader, then the events still in the ring, oldest first.
+#ifndef WFQ_TRACE_H
+#define WFQ_TRACE_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#ifndef WFQ_TRACE
+#define WFQ_TRACE 0
+#endif
+#ifndef WFQ_TRACE_RING_BITS
+#define WFQ_TRACE_RING_BITS 20
+#endif
+#define WFQ_TRACE_MAGIC "WFQEVTS"
+#define WFQ_TRACE_VERSION 1
+
+// event types
+#define WFQ_EV_ARRIVAL 0 // packet enqueued, a = flow weight
+#define WFQ_EV_TAGS 1 // tags assigned, a = VST, b = VFT
+#define WFQ_EV_BUS_WAIT 2 // GPS: waits for the virtual clock to reach its VST, a = VST
+#define WFQ_EV_BUS_ENTER 3 // GPS: starts being served by the emulated system, a = VFT
+#define WFQ_EV_BUS_LEAVE 4 // GPS: finished in the emulated system, a = VFT
+#define WFQ_EV_TRANSMIT 5 // goes on the link, a = start time, b = VFT (0 for DRR)
+#define WFQ_EV_TYPES 6
+
+typedef struct {
+    double real_time; // scheduler clock when it happened
+    double virtual_time;
+    double a, b; // depend on the type, see above
+    int type;
+    int flow;
+    int packet; // enqueue order within the scheduler
+    int length;
+} WfqTraceEvent;
+
+typedef struct {
+    char magic[8];
+    int version;
+    int record_size;
+    unsigned long long total; // events ever recorded
+    unsigned long long count; // events in the file, the last ones of total
+} WfqTraceHeader;
+
+struct WfqTraceRing {
+    std::vector<WfqTraceEvent> events;
+    unsigned long long total;
+
+    WfqTraceRing() : events((size_t)1 << WFQ_TRACE_RING_BITS), total(0) {}
+
+    void record(int type, int flow, int packet, int length, double real_time, double virtual_time, double a, double b) {
+        WfqTraceEvent* event = &events[(size_t)(total++ & (events.size() - 1))];
+        event->real_time = real_time;
+        event->virtual_time = virtual_time;
+        event->a = a;
+        event->b = b;
+        event->type = type;
+        event->flow = flow;
+        event->packet = packet;
+        event->length = length;
+    }
+};
+
+// returns 0 on success
+static inline int wfq_trace_write(const WfqTraceRing* ring, FILE* file) {
+    WfqTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WFQ_TRACE_MAGIC, sizeof(WFQ_TRACE_MAGIC));
+    header.version = WFQ_TRACE_VERSION;
+    header.record_size = (int)sizeof(WfqTraceEvent);
+    header.total = ring->total;
+    header.count = (ring->total < ring->events.size()) ? ring->total : ring->events.size();
+    if (fwrite(&header, sizeof(header), 1, file) != 1) return 1;
+    size_t size = ring->events.size();
+    size_t first = (size_t)((ring->total - header.count) & (size - 1));
+    size_t tail = (first + header.count <= size) ? (size_t)header.count : size - first;
+    if (fwrite(&ring->events[first], sizeof(WfqTraceEvent), tail, file) != tail) return 1;
+    size_t wrapped = (size_t)header.count - tail;
+    if (wrapped && fwrite(&ring->events[0], sizeof(WfqTraceEvent), wrapped, file) != wrapped) return 1;
+    return 0;
+}
+
+#if WFQ_TRACE
+#define WFQ_TRACE_EVENT(type, packet, a, b) \
+    trace.record((type), (packet)->flow, (packet)->appearance_order, (packet)->length, RT_TO_DOUBLE(current_time), \
+                 VT_TO_DOUBLE(virtual_time), (a), (b))
+#else
+#define WFQ_TRACE_EVENT(type, packet, a, b)
+#endif
+
+#endif